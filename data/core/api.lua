@@ -85,6 +85,9 @@ local env = {
     pal = gfx.pal,
     icon = gfx.icon,
     clear = gfx.clear,
+    cmdlist = gfx.cmdlist,
+    workers = gfx.workers,
+    tilemap = gfx.tilemap,
   };
   sys = {
     running = sys.running,
@@ -237,45 +240,15 @@ function env.gfx.win(w, h, fnt, sz) -- create new win or change
   return oscr
 end
 
-local flipsx, flipsy, flipsxy = {}, {}, {}
-
 function env.gfx.spr(data, nr, x, y, w, h, flipx, flipy)
-  local flips
-  local W, _ = data:size()
-  local nsp = math.floor(W/8)
-  w = w or 1
-  h = h or 1
-  local fx = nr % nsp
-  local fy = math.floor(nr / nsp)
-  if flipx and not flipy then
-    flips = flipsx
-  elseif not flipx and flipy then
-    flips = flipsy
-  elseif flipx and flipy then
-    flips = flipsxy
-  end
-
-  if not flips then
-    data:blend(fx * 8, fy * 8, w * 8, h * 8, env.screen, x, y)
-    return
-  end
-  flips[data] = flips[data] or {}
-  flips = flips[data]
+  gfx.spr(data, env.screen, nr, x, y, w, h, flipx, flipy)
+end
 
-  if flips[nr] then
-    flips[nr]:blend(env.screen, x, y)
-    return
+function env.gfx.spr_batch(data, target, sprites)
+  if not sprites then
+    target, sprites = env.screen, target
   end
-  flips[nr] = gfx.new(w*8, h*8)
-  data:blend(fx * 8, fy * 8, w * 8, h * 8, flips[nr], 0, 0)
-  if flipx then
-    flips[nr] = flips[nr]:flip(true, false)
-  end
-  if flipy then
-    flips[nr] = flips[nr]:flip(false, true)
-  end
-  flips[nr]:blend(env.screen, x, y)
-  return
+  gfx.spr_batch(data, target, sprites)
 end
 
 function env.gfx.loadmap(fname)
@@ -300,9 +273,9 @@ function env.gfx.loadmap(fname)
   return map
 end
 
-function env.gfx.new(x, y)
+function env.gfx.new(x, y, mode)
   if type(x) == 'number' and type(y) == 'number' then
-    return gfx.new(x, y)
+    return gfx.new(x, y, mode)
   end
   if type(x) == 'string' then
     if x:find("\n") then
@@ -363,7 +336,7 @@ end
 
 function env.gfx.sync(fps, interrupt)
   if interrupt or not framedrop then -- drop every 2nd frame if needed
-    gfx.flip()
+    core.flip()
   end
   local cur_time = sys.time()
   local delta = (fps or conf.fps) - (cur_time - last_flip)
@@ -492,12 +465,7 @@ function env.gfx.print(text, x, y, col, scroll)
     if not s then s = text:len() end
     local nl = text:sub(s, s) == '\n'
     local word = text:sub(1, s):gsub("\n$", "")
-    local p = env.font:text(word, col)
-    if p then
-      ww, hh = p:size()
-    else
-      ww = 0
-    end
+    ww, hh = env.font:size(word)
     if x + ww > w and scroll then
       x = 0 --startx
       y = y + hh
@@ -510,8 +478,8 @@ function env.gfx.print(text, x, y, col, scroll)
       y = y - off
     end
 
-    if p then
-      p:blend(env.screen, x, y)
+    if ww > 0 then
+      env.font:draw(env.screen, word, x, y, col)
     end
     x = x + ww
     text = text:sub(s + 1)
@@ -709,6 +677,7 @@ function api.event(e, v, a, b, c)
   end
 
   if e == 'resized' or e == 'exposed' then
+    core.redraw = true
     gfx.background(conf.brd)
     return true
   end
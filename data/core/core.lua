@@ -136,6 +136,7 @@ function core.init()
     nosound = true,
     vpad = true,
     fs = true,
+    direct = true,
   })
   core.fullscreen = opts.fs
   if core.fullscreen then
@@ -144,6 +145,7 @@ function core.init()
   core.scale = opts.s
   core.nosound = opts.nosound
   core.vpad_enabled = opts.vpad
+  core.direct = opts.direct
   if optarg <= #ARGS then
     for i=optarg,#ARGS do
       table.insert(env.ARGS, ARGS[i])
@@ -164,6 +166,7 @@ function core.done()
 end
 
 local last_render = 0
+local last_frame = {} -- screen and window size of the last exposed frame
 
 local vpad = { fingers = {}, btn = {} }
 local vpad_col = { 192, 192, 192, 255 }
@@ -283,6 +286,16 @@ function core.render(force)
     return
   end
   local ww, hh = sys:window_size()
+  if not core.vpad_enabled and not core.redraw and
+    last_frame.screen == env.screen and
+    last_frame.w == ww and last_frame.h == hh and
+    not env.screen:dirty() then -- nothing changed
+    last_render = start
+    return true
+  end
+  core.redraw = false
+  last_frame.screen, last_frame.w, last_frame.h = env.screen, ww, hh
+  core.exposed = true
   local w, h = env.screen:size()
   local xs, ys = ww/w, hh/h
   local scale = (xs <= ys) and xs or ys
@@ -308,6 +321,9 @@ function core.render(force)
     env.screen:expose(core.view_x, core.view_y, core.view_w, core.view_h)
 --    gfx.flip()
   else
+    if core.direct then
+      env.screen:direct(true)
+    end
     env.screen:expose(core.view_x, core.view_y, core.view_w, core.view_h)
 --    gfx.flip()
   end
@@ -315,6 +331,14 @@ function core.render(force)
   return true
 end
 
+function core.flip()
+  if not core.exposed then -- keep the last frame
+    return
+  end
+  core.exposed = false
+  gfx.flip()
+end
+
 function core.abs2rel(x, y)
   if not env.screen then
     return x, y
@@ -380,7 +404,7 @@ function core.run()
   end
 
   if core.render() then
-    gfx.flip()
+    core.flip()
     sys.sleep(fps)
   end
   return api.event() -- check is running
@@ -57,9 +57,12 @@ img_init(img_t *img, int w, int h)
 		return;
 	img->w = w;
 	img->h = h;
+	img->stride = w;
 	img_noclip(img);
 	img_offset(img, 0, 0);
 	img->used = 1;
+	img->bpp = 4;
+	img->mode = PXL_BLEND_BLEND;
 }
 
 void
@@ -139,8 +142,26 @@ struct lua_pixels {
 	int type;
 	size_t size;
 	img_t img;
+	struct lua_pixels *parent; /* owner of memory for views */
+	int ref;
+	int direct; /* draw right into the window texture */
+	unsigned char *mem; /* own memory while ptr is in the texture */
+	unsigned char *dirty; /* tiles changed since last expose */
+	int ndirty; /* number of changed tiles, -1 - whole image */
+	int shared; /* memory is written by other threads */
+	unsigned int gen; /* bumped on every change */
+	unsigned char *spans; /* runs of alpha for blits, see spans_build */
+	unsigned int spans_gen;
+	int spans_ok; /* -1 - not worth it */
+	int ring_x; /* scroll origin, see pixels_ring_call */
+	int ring_y;
 };
 
+#define DIRTY_TILE 16
+
+static struct lua_pixels *direct_pxl = NULL; /* attached to the texture */
+static struct lua_pixels *expose_last = NULL; /* texture holds its pixels */
+
 static int
 checkcolorpat(lua_State *L, int idx, color_t *col, img_t **pat)
 {
@@ -159,58 +180,76 @@ checkcolorpat(lua_State *L, int idx, color_t *col, img_t **pat)
 }
 
 static __inline void
-blend(unsigned char *s, unsigned char *d)
+pixel_textured(img_t *img, unsigned char *d, int x, int y)
 {
-	unsigned int r, g, b, a;
-	unsigned int sa = s[3];
-	unsigned int da = d[3];
-	a = sa + (da * (255 - sa) >> 8);
-	r = ((unsigned int)s[0] * sa >> 8) +
-		((unsigned int)d[0] * da * (255 - sa) >> 16);
-	g = ((unsigned int)s[1] * sa >> 8) +
-		((unsigned int)d[1] * da * (255 - sa) >> 16);
-	b = ((unsigned int)s[2] * sa >> 8) +
-		((unsigned int)d[2] * da * (255 - sa) >> 16);
-	d[0] = r; d[1] = g; d[2] = b; d[3] = a;
+	unsigned char *src = img->ptr;
+	src += (((y % img->h) * img->stride + (x % img->w)) * 4);
+	pixel(src, d);
 }
 
-static __inline void
-draw(unsigned char *s, unsigned char *d)
+/* mark x1,y1 - x2,y2 in image coordinates as changed */
+static void
+pixels_mark(struct lua_pixels *hdr, int x1, int y1, int x2, int y2)
 {
-	unsigned int r, g, b, a;
-	unsigned int sa = s[3];
-	a = 255;
-	r = ((unsigned int)s[0] * sa >> 8) +
-		((unsigned int)d[0] * (255 - sa) >> 8);
-	g = ((unsigned int)s[1] * sa >> 8) +
-		((unsigned int)d[1] * (255 - sa) >> 8);
-	b = ((unsigned int)s[2] * sa >> 8) +
-		((unsigned int)d[2] * (255 - sa) >> 8);
-	d[0] = r; d[1] = g; d[2] = b; d[3] = a;
+	struct lua_pixels *owner = hdr;
+	unsigned char *t;
+	int x, y, tw;
+	if (x1 > x2) {
+		x = x1; x1 = x2; x2 = x;
+	}
+	if (y1 > y2) {
+		y = y1; y1 = y2; y2 = y;
+	}
+	x1 = MAX(x1, 0);
+	y1 = MAX(y1, 0);
+	x2 = MIN(x2, hdr->img.w - 1);
+	y2 = MIN(y2, hdr->img.h - 1);
+	if (x1 > x2 || y1 > y2)
+		return;
+	if (hdr->parent) { /* view, mark in owner */
+		owner = hdr->parent;
+		x = (hdr->img.ptr - owner->img.ptr) / 4;
+		y = x / owner->img.stride;
+		x %= owner->img.stride;
+		x1 += x; x2 += x;
+		y1 += y; y2 += y;
+	}
+	owner->gen ++;
+	if (!owner->dirty || owner->ndirty < 0)
+		return;
+	tw = (owner->img.w + DIRTY_TILE - 1) / DIRTY_TILE;
+	for (y = y1 / DIRTY_TILE; y <= y2 / DIRTY_TILE; y++) {
+		t = owner->dirty + y * tw;
+		for (x = x1 / DIRTY_TILE; x <= x2 / DIRTY_TILE; x++) {
+			if (t[x])
+				continue;
+			t[x] = 1;
+			owner->ndirty ++;
+		}
+	}
 }
 
-static __inline void
-pixel(unsigned char *s, unsigned char *d)
-{
-	unsigned char a_src = s[3];
-	unsigned char a_dst = d[3];
-	if (a_src == 255 || a_dst == 0) {
-		memcpy(d, s, 4);
-	} else if (a_src == 0) {
-		/* nothing to do */
-	} else if (a_dst == 255) {
-		draw(s, d);
-	} else {
-		blend(s, d);
-	}
+/* area x1,y1 - x2,y2 in drawing coordinates to clipped image area */
+static int
+img_bounds(img_t *img, int x1, int y1, int x2, int y2, int *r)
+{
+	r[0] = MAX(MIN(x1, x2) + img->xoff, img->clip_x1);
+	r[1] = MAX(MIN(y1, y2) + img->yoff, img->clip_y1);
+	r[2] = MIN(MAX(x1, x2) + img->xoff, img->clip_x2 - 1);
+	r[3] = MIN(MAX(y1, y2) + img->yoff, img->clip_y2 - 1);
+	if (r[0] > r[2] || r[1] > r[3])
+		return -1;
+	return 0;
 }
 
-static __inline void
-pixel_textured(img_t *img, unsigned char *d, int x, int y)
+/* same as pixels_mark, but in drawing coordinates */
+static void
+pixels_mark_draw(struct lua_pixels *hdr, int x1, int y1, int x2, int y2)
 {
-	unsigned char *src = img->ptr;
-	src += (((y % img->h) * img->w + (x % img->w)) * 4);
-	pixel(src, d);
+	int r[4];
+	if (img_bounds(&hdr->img, x1, y1, x2, y2, r))
+		return;
+	pixels_mark(hdr, r[0], r[1], r[2], r[3]);
 }
 
 static int
@@ -232,7 +271,7 @@ pixels_value(lua_State *L)
 		return 0;
 
 	ptr = hdr->img.ptr;
-	ptr += ((y * hdr->img.w + x) * 4);
+	ptr += ((y * hdr->img.stride + x) * 4);
 	if (get) {
 		lua_pushinteger(L, *(ptr ++));
 		lua_pushinteger(L, *(ptr ++));
@@ -240,6 +279,7 @@ pixels_value(lua_State *L)
 		lua_pushinteger(L, *ptr);
 		return 4;
 	}
+	pixels_mark(hdr, x, y, x, y);
 	*(ptr ++) = col.r;
 	*(ptr ++) = col.g;
 	*(ptr ++) = col.b;
@@ -270,7 +310,7 @@ pixels_pixel(lua_State *L)
 		return 0;
 
 	ptr = hdr->img.ptr;
-	ptr += ((y * hdr->img.w + x) * 4);
+	ptr += ((y * hdr->img.stride + x) * 4);
 	if (get) {
 		lua_pushinteger(L, *(ptr ++));
 		lua_pushinteger(L, *(ptr ++));
@@ -278,6 +318,7 @@ pixels_pixel(lua_State *L)
 		lua_pushinteger(L, *ptr);
 		return 4;
 	}
+	pixels_mark(hdr, x, y, x, y);
 	col[0] = color.r; col[1] = color.g; col[2] = color.b; col[3] = color.a;
 	pixel(col, ptr);
 	return 0;
@@ -295,13 +336,17 @@ pixels_buff(lua_State *L)
 
 	if (!lua_istable(L, 2)) { /* return actual table */
 		lua_newtable(L);
-		for (i = 0; i < hdr->img.w * hdr->img.h; i++) {
-			col = *(ptr++);
-			col = (col << 8) | *(ptr++);
-			col = (col << 16) | *(ptr++);
-			col = (col << 24) | *(ptr++);
-			lua_pushnumber(L, col);
-			lua_rawseti(L, -2, i + 1);
+		for (y = 0; y < hdr->img.h; y ++) {
+			pptr = ptr;
+			for (x = 0; x < hdr->img.w; x ++) {
+				col = *(ptr++);
+				col = (col << 8) | *(ptr++);
+				col = (col << 16) | *(ptr++);
+				col = (col << 24) | *(ptr++);
+				lua_pushnumber(L, col);
+				lua_rawseti(L, -2, ++i);
+			}
+			ptr = pptr + hdr->img.stride*4;
 		}
 		return 1;
 	}
@@ -313,7 +358,8 @@ pixels_buff(lua_State *L)
 		if (x < 0 || y < 0 || x + w > hdr->img.w ||
 			y + h > hdr->img.h)
 			return 0;
-		ptr += (y*hdr->img.w + x)*4;
+		pixels_mark(hdr, x, y, x + w - 1, y + h - 1);
+		ptr += (y*hdr->img.stride + x)*4;
 		for (y = 0; y < h; y ++) {
 			pptr = ptr;
 			for (x = 0; x < w; x ++) {
@@ -326,22 +372,80 @@ pixels_buff(lua_State *L)
 				lua_pop(L, 1);
 				i ++;
 			}
-			ptr = pptr + hdr->img.w*4;
+			ptr = pptr + hdr->img.stride*4;
 		}
 		return 0;
 	}
-	for (i = 0; i < hdr->img.w * hdr->img.h; i ++) {
-		lua_rawgeti(L, 2, i + 1);
-		col = luaL_checknumber(L, -1);
-		*(ptr++) = (col & 0xff000000) >> 24;
-		*(ptr++) = (col & 0xff0000) >> 16;
-		*(ptr++) = (col & 0xff00) >> 8;
-		*(ptr++) = (col & 0xff);
-		lua_pop(L, 1);
+	pixels_mark(hdr, 0, 0, hdr->img.w - 1, hdr->img.h - 1);
+	for (y = 0; y < hdr->img.h; y ++) {
+		pptr = ptr;
+		for (x = 0; x < hdr->img.w; x ++) {
+			lua_rawgeti(L, 2, i + 1);
+			col = luaL_checknumber(L, -1);
+			*(ptr++) = (col & 0xff000000) >> 24;
+			*(ptr++) = (col & 0xff0000) >> 16;
+			*(ptr++) = (col & 0xff00) >> 8;
+			*(ptr++) = (col & 0xff);
+			lua_pop(L, 1);
+			i ++;
+		}
+		ptr = pptr + hdr->img.stride*4;
 	}
 	return 0;
 }
 
+/* [x, y, w, h] of the image, 0 if it is not inside */
+static int
+pixels_area(lua_State *L, int idx, struct lua_pixels *hdr, int *r)
+{
+	r[0] = luaL_optinteger(L, idx, 0);
+	r[1] = luaL_optinteger(L, idx + 1, 0);
+	r[2] = luaL_optinteger(L, idx + 2, hdr->img.w - r[0]);
+	r[3] = luaL_optinteger(L, idx + 3, hdr->img.h - r[1]);
+	return !(r[0] < 0 || r[1] < 0 || r[2] <= 0 || r[3] <= 0 ||
+		r[0] + r[2] > hdr->img.w || r[1] + r[3] > hdr->img.h);
+}
+
+/* packed rgba rows as a string */
+static int
+pixels_data(lua_State *L)
+{
+	int r[4], y;
+	luaL_Buffer b;
+	unsigned char *ptr;
+	struct lua_pixels *hdr = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	if (!pixels_area(L, 2, hdr, r))
+		return 0;
+	ptr = hdr->img.ptr + (r[1] * hdr->img.stride + r[0]) * 4;
+	if (r[2] == hdr->img.stride) { /* one piece */
+		lua_pushlstring(L, (const char *)ptr, (size_t)r[2] * r[3] * 4);
+		return 1;
+	}
+	luaL_buffinit(L, &b);
+	for (y = 0; y < r[3]; y ++, ptr += hdr->img.stride * 4)
+		luaL_addlstring(&b, (const char *)ptr, r[2] * 4);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+static int
+pixels_set_data(lua_State *L)
+{
+	int r[4], y;
+	size_t len;
+	unsigned char *ptr;
+	struct lua_pixels *hdr = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	const char *data = luaL_checklstring(L, 2, &len);
+	if (!pixels_area(L, 3, hdr, r) || len < (size_t)r[2] * r[3] * 4)
+		return 0;
+	pixels_mark(hdr, r[0], r[1], r[0] + r[2] - 1, r[1] + r[3] - 1);
+	ptr = hdr->img.ptr + (r[1] * hdr->img.stride + r[0]) * 4;
+	for (y = 0; y < r[3]; y ++, ptr += hdr->img.stride * 4, data += r[2] * 4)
+		memcpy(ptr, data, r[2] * 4);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 static struct lua_pixels *
 pixels_new(lua_State *L, int w, int h)
 {
@@ -362,6 +466,19 @@ pixels_new(lua_State *L, int w, int h)
 		return 0;
 	}
 	img_init(&hdr->img, w, h);
+	hdr->parent = NULL;
+	hdr->ref = LUA_NOREF;
+	hdr->direct = 0;
+	hdr->mem = NULL;
+	hdr->dirty = NULL;
+	hdr->ndirty = -1;
+	hdr->shared = 0;
+	hdr->gen = 0;
+	hdr->spans = NULL;
+	hdr->spans_gen = hdr->gen - 1; /* built after a repeat */
+	hdr->spans_ok = 0;
+	hdr->ring_x = 0;
+	hdr->ring_y = 0;
 	memset(hdr->img.ptr, 0, size);
 	luaL_getmetatable(L, "pixels metatable");
 	lua_setmetatable(L, -2);
@@ -439,7 +556,7 @@ img_pixels_stretch(img_t *src, img_t *dst, int xoff, int yoff, int ww, int hh)
 	w = src->w;
 	h = src->h;
 
-	p = dst->ptr + (yoff*dst->w + xoff)*4;
+	p = dst->ptr + (yoff*dst->stride + xoff)*4;
 
 	dy = 0;
 
@@ -461,10 +578,10 @@ img_pixels_stretch(img_t *src, img_t *dst, int xoff, int yoff, int ww, int hh)
 			break;
 		if (yy < dst->clip_y1) {
 			if (optr)
-				p += dst->w * 4;
+				p += dst->stride * 4;
 			else {
 				optr = p;
-				p = optr + dst->w * 4;
+				p = optr + dst->stride * 4;
 			}
 			goto skip;
 		}
@@ -472,7 +589,7 @@ img_pixels_stretch(img_t *src, img_t *dst, int xoff, int yoff, int ww, int hh)
 		dx = 0;
 		if (optr) {
 			memcpy(p + xdisp, optr + xdisp, wdisp * 4);
-			p += dst->w * 4;
+			p += dst->stride * 4;
 		} else {
 			optr = p;
 			for (xx = xoff; xx < xoff + ww; xx++) {
@@ -487,13 +604,13 @@ img_pixels_stretch(img_t *src, img_t *dst, int xoff, int yoff, int ww, int hh)
 					ptrl += 4;
 				}
 			}
-			p = optr + dst->w * 4;
+			p = optr + dst->stride * 4;
 		}
 skip:
 		dy += h;
 		while (dy >= hh) {
 			dy -= hh;
-			ptr += (w * 4);
+			ptr += (src->stride * 4);
 			optr = NULL;
 		}
 	}
@@ -511,7 +628,7 @@ img_scale(img_t *src, float xscale, float yscale, int smooth)
 	if (!smooth)
 		img_pixels_stretch(src, ret, 0, 0, w, h);
 	else
-		stbir_resize_uint8(src->ptr, src->w, src->h, 0,
+		stbir_resize_uint8(src->ptr, src->w, src->h, src->stride * 4,
 			ret->ptr, w, h, 0, 4);
 	return ret;
 }
@@ -525,25 +642,27 @@ _img_flip(img_t *src, int h, int v, img_t *dst)
 	d = dst->ptr;
 
 	if (v)
-		s += (src->h - 1) * src->w * 4;
+		s += (src->h - 1) * src->stride * 4;
 
 	if (h)
 		s += (src->w - 1) * 4;
 
 	for (y = 0; y < src->h; y++) {
+		unsigned char *sp = s;
+		unsigned char *dp = d;
 		for (x = 0; x < src->w; x++) {
-			*(unsigned int*)d = *(unsigned int*)s;
+			*(unsigned int*)dp = *(unsigned int*)sp;
 			if (h)
-				s -= 4;
+				sp -= 4;
 			else
-				s += 4;
-			d += 4;
-		}
-		if (!v && h) {
-			s += (src->w * 8);
-		} else if (v && !h) {
-			s -= (src->w * 8);
+				sp += 4;
+			dp += 4;
 		}
+		if (v)
+			s -= src->stride * 4;
+		else
+			s += src->stride * 4;
+		d += dst->stride * 4;
 	}
 }
 
@@ -556,6 +675,33 @@ pixels_size(lua_State *L)
 	return 2;
 }
 
+/* blend_row() or blend_op_row() for drawing mode */
+static __inline void
+blend_mode_row(unsigned char *s, unsigned char *d, int w, int mode)
+{
+	if (mode > PXL_BLEND_BLEND)
+		blend_op_row(s, d, w, mode);
+	else
+		blend_row(s, d, w);
+}
+
+static void
+blend_mode_fill_row(unsigned char *col, unsigned char *d, int w, int mode)
+{
+	unsigned char row[64 * 4];
+	int i, n;
+	if (mode <= PXL_BLEND_BLEND) {
+		blend_fill_row(col, d, w);
+		return;
+	}
+	for (i = 0; i < MIN(w, 64); i++)
+		memcpy(row + i * 4, col, 4);
+	for (; w > 0; w -= n, d += n * 4) {
+		n = MIN(w, 64);
+		blend_op_row(row, d, n, mode);
+	}
+}
+
 static void
 _fill(img_t *src, int x, int y, int w, int h,
 		  color_t *color, int mode, img_t *pat)
@@ -593,21 +739,63 @@ _fill(img_t *src, int x, int y, int w, int h,
 		h = src->clip_y2 - y;
 
 	ptr1 = src->ptr;
-	ptr1 += (y * src->w + x) * 4;
+	ptr1 += (y * src->stride + x) * 4;
 	for (cy = 0; cy < h; cy ++) {
 		unsigned char *p1 = ptr1;
-		for (cx = 0; cx < w; cx ++) {
-			if (mode == PXL_BLEND_COPY)
+		if (mode == PXL_BLEND_COPY) {
+			for (cx = 0; cx < w; cx ++) {
 				memcpy(p1, col, 4);
-			else
-				pat?pixel_textured(pat, p1, x + cx, y + cy):pixel(col, p1);
-			p1 += 4;
-		}
-		ptr1 += (src->w * 4);
+				p1 += 4;
+			}
+		} else if (pat) {
+			unsigned char *pp = pat->ptr +
+				((y + cy) % pat->h) * pat->stride * 4;
+			int px = x % pat->w;
+			for (cx = 0; cx < w; ) { /* pattern runs */
+				int n = MIN(w - cx, pat->w - px);
+				blend_mode_row(pp + px * 4, p1, n, src->mode);
+				p1 += n * 4;
+				cx += n;
+				px = 0;
+			}
+		} else
+			blend_mode_fill_row(col, p1, w, src->mode);
+		ptr1 += (src->stride * 4);
 	}
 	return;
 }
 
+/* opaque fills are copies, unless there is a blend mode */
+static __inline int
+fill_mode(img_t *img, color_t *col)
+{
+	return (col->a == 255 && img->mode == PXL_BLEND_BLEND) ?
+		PXL_BLEND_COPY : PXL_BLEND_BLEND;
+}
+
+static int
+img_fill_bounds(img_t *img, int x, int y, int w, int h, int *r)
+{
+	/* zero size is the whole image without offset, see _fill() */
+	if (!w) {
+		x -= img->xoff;
+		w = img->w;
+	}
+	if (!h) {
+		y -= img->yoff;
+		h = img->h;
+	}
+	return img_bounds(img, x, y, x + w - 1, y + h - 1, r);
+}
+
+static void
+pixels_mark_fill(struct lua_pixels *src, int x, int y, int w, int h)
+{
+	int r[4];
+	if (img_fill_bounds(&src->img, x, y, w, h, r))
+		return;
+	pixels_mark(src, r[0], r[1], r[2], r[3]);
+}
 
 static int
 pixels_fill(lua_State *L)
@@ -629,8 +817,8 @@ pixels_fill(lua_State *L)
 	}
 	checkcolorpat(L, col_idx, &col, &pat);
 
-	_fill(&src->img, x, y, w, h, &col,
-		col.a == 255 ? PXL_BLEND_COPY:PXL_BLEND_BLEND, pat);
+	pixels_mark_fill(src, x, y, w, h);
+	_fill(&src->img, x, y, w, h, &col, fill_mode(&src->img, &col), pat);
 	return 0;
 }
 
@@ -655,8 +843,8 @@ pixels_fill_rect(lua_State *L)
 	xmin = (x1<x2)?x1:x2;
 	ymin = (y1<y2)?y1:y2;
 
-	_fill(&src->img, xmin, ymin, w, h, &col,
-		col.a == 255 ? PXL_BLEND_COPY:PXL_BLEND_BLEND, pat);
+	pixels_mark_fill(src, xmin, ymin, w, h);
+	_fill(&src->img, xmin, ymin, w, h, &col, fill_mode(&src->img, &col), pat);
 	return 0;
 }
 
@@ -677,6 +865,7 @@ pixels_clear(lua_State *L)
 		h = luaL_optnumber(L, 5, 0);
 		checkcolor(L, 6, &col);
 	}
+	pixels_mark_fill(src, x, y, w, h);
 	_fill(&src->img, x, y, w, h, &col, PXL_BLEND_COPY, NULL);
 	return 0;
 }
@@ -687,7 +876,7 @@ img_pixels_blend(img_t *src, int x, int y, int w, int h,
 			img_t *dst, int xx, int yy, int mode)
 {
 	unsigned char *ptr1, *ptr2;
-	int cy, cx, srcw, dstw;
+	int cy, srcw, dstw;
 
 	if (x < 0 || x + w > src->w ||
 		y < 0 || y + h > src->h)
@@ -730,56 +919,302 @@ img_pixels_blend(img_t *src, int x, int y, int w, int h,
 
 	ptr1 = src->ptr;
 	ptr2 = dst->ptr;
-	ptr1 += (y * src->w + x) * 4;
-	ptr2 += (yy * dst->w + xx) * 4;
-	srcw = src->w * 4; dstw = dst->w * 4;
+	ptr1 += (y * src->stride + x) * 4;
+	ptr2 += (yy * dst->stride + xx) * 4;
+	srcw = src->stride * 4; dstw = dst->stride * 4;
 	for (cy = 0; cy < h; cy ++) {
 		if (mode == PXL_BLEND_COPY)
 			memcpy(ptr2, ptr1, w * 4);
-		else {
-			unsigned char *p2 = ptr2;
-			unsigned char *p1 = ptr1;
-			for (cx = 0; cx < w; cx ++) {
-				pixel(p1, p2);
-				p1 += 4;
-				p2 += 4;
-			}
-		}
+		else
+			blend_mode_row(ptr1, ptr2, w, dst->mode);
 		ptr2 += dstw;
 		ptr1 += srcw;
 	}
 	return 0;
 }
 
+/*
+   Every pixel of a blit source gets a byte: kind of the run it
+   belongs to in two upper bits and the number of pixels left in
+   the run (up to SPANS_RUN) in the lower ones. So blits can start
+   at any x and jump over transparent runs and copy opaque ones.
+   SIMD blend_row does the same for groups of pixels by itself, so
+   there the tables are used only for other blend modes, where
+   transparent pixels change nothing and are not even read.
+*/
+#define SPANS_SKIP 0
+#define SPANS_COPY 1
+#define SPANS_BLEND 2
+#define SPANS_RUN 64
+#define SPANS_MIN 16 /* shorter runs are blended */
+
 static int
-pixels_copy(lua_State *L)
+spans_build(img_t *img, unsigned char *spans)
 {
-	int x = 0, y = 0, w = 0, h = 0, xx = 0, yy = 0;
-	struct lua_pixels *src, *dst;
-	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
-	dst = (struct lua_pixels*)lua_touserdata(L, 2);
-	if (!dst) {
-		x = luaL_optnumber(L, 2, 0);
-		y = luaL_optnumber(L, 3, 0);
-		w = luaL_optnumber(L, 4, 0);
-		h = luaL_optnumber(L, 5, 0);
-		dst = (struct lua_pixels*)luaL_checkudata(L, 6, "pixels metatable");
-		xx = luaL_optnumber(L, 7, 0);
-		yy = luaL_optnumber(L, 8, 0);
-	} else {
-		xx = luaL_optnumber(L, 3, 0);
-		yy = luaL_optnumber(L, 4, 0);
+	int x, y, k, n, prev, runs = 0;
+	unsigned char *p, *sp;
+	for (y = 0; y < img->h; y++) {
+		p = img->ptr + y * img->stride * 4 + 3;
+		sp = spans + y * img->w;
+		for (x = 0; x < img->w; x++, p += 4) /* kinds */
+			sp[x] = (*p == 0) ? SPANS_SKIP : ((*p == 255) ? SPANS_COPY : SPANS_BLEND);
+		for (x = 0; x < img->w; x += n) { /* short runs are not worth a jump */
+			for (n = 1; x + n < img->w && sp[x + n] == sp[x]; n++);
+			if (n < SPANS_MIN)
+				memset(sp + x, SPANS_BLEND, n);
+			else if (sp[x] != SPANS_BLEND)
+				runs += n;
+		}
+		prev = -1;
+		n = 0;
+		for (x = img->w - 1; x >= 0; x--) {
+			k = sp[x];
+			if (k == prev && n < SPANS_RUN)
+				n ++;
+			else {
+				n = 1;
+				prev = k;
+			}
+			sp[x] = (k << 6) | (n - 1);
+		}
 	}
-	if (dst->type != PIXELS_MAGIC)
+	return runs;
+}
+
+static void
+blend_row_spans(unsigned char *s, unsigned char *d, const unsigned char *sp, int w,
+	int mode)
+{
+	int n, i, z;
+	while (w > 0) {
+		n = MIN((*sp & (SPANS_RUN - 1)) + 1, w);
+		if (mode > PXL_BLEND_BLEND && (*sp >> 6) != SPANS_SKIP) {
+			while (n < w && (sp[n] >> 6) != SPANS_SKIP) /* one call for all */
+				n += MIN((sp[n] & (SPANS_RUN - 1)) + 1, w - n);
+			blend_op_row(s, d, n, mode);
+		} else if (mode > PXL_BLEND_BLEND) {
+			/* nothing to do */
+		} else switch (*sp >> 6) {
+		case SPANS_SKIP: /* pixel() still copies into empty pixels */
+			for (i = 3, z = 0; i < n * 4; i += 4)
+				z |= !d[i];
+			for (i = 3; z && i < n * 4; i += 4) {
+				if (!d[i])
+					memcpy(d + i - 3, s + i - 3, 4);
+			}
+			break;
+		case SPANS_COPY:
+			memcpy(d, s, n * 4);
+			break;
+		default:
+			blend_row(s, d, n);
+			break;
+		}
+		s += n * 4;
+		d += n * 4;
+		sp += n;
+		w -= n;
+	}
+}
+
+/* blend w x h area, mirrored on the fly */
+static void
+img_pixels_blend_flip(img_t *src, int x, int y, int w, int h,
+			img_t *dst, int xx, int yy, int flipx, int flipy,
+			const unsigned char *spans, int spitch)
+{
+	unsigned char row[64 * 4];
+	unsigned char *s, *d;
+	int cy, cx, ry, sy, cw, ch, dx1, dy1, i, n;
+
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		x + w > src->w || y + h > src->h)
+		return;
+
+	xx += dst->xoff;
+	yy += dst->yoff;
+
+	dx1 = MAX(dst->clip_x1 - xx, 0); /* clipped columns and rows */
+	dy1 = MAX(dst->clip_y1 - yy, 0);
+	cw = MIN(xx + w, dst->clip_x2) - xx - dx1;
+	ch = MIN(yy + h, dst->clip_y2) - yy - dy1;
+	if (cw <= 0 || ch <= 0)
+		return;
+
+	for (cy = 0; cy < ch; cy ++) {
+		ry = dy1 + cy;
+		sy = y + (flipy ? h - 1 - ry : ry);
+		d = dst->ptr + ((yy + ry) * dst->stride + xx + dx1) * 4;
+		if (!flipx && spans) {
+			blend_row_spans(src->ptr + (sy * src->stride + x + dx1) * 4, d,
+				spans + sy * spitch + x + dx1, cw, dst->mode);
+			continue;
+		}
+		if (!flipx) {
+			blend_mode_row(src->ptr + (sy * src->stride + x + dx1) * 4, d, cw,
+				dst->mode);
+			continue;
+		}
+		for (cx = 0; cx < cw; cx += n) { /* reversed runs */
+			n = MIN(cw - cx, 64);
+			s = src->ptr + (sy * src->stride + x + w - 1 - dx1 - cx) * 4;
+			for (i = 0; i < n; i ++)
+				memcpy(row + i * 4, s - i * 4, 4);
+			blend_mode_row(row, d + cx * 4, n, dst->mode);
+		}
+	}
+}
+
+/* w x h area in any mode, source is multiplied by mod (if any) on the fly */
+static void
+img_pixels_blend_mod(img_t *src, int x, int y, int w, int h,
+			img_t *dst, int xx, int yy, int mode, unsigned char *mod)
+{
+	unsigned char row[64 * 4];
+	unsigned char *s, *d;
+	int cy, cx, cw, ch, dx1, dy1, n;
+
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		x + w > src->w || y + h > src->h)
+		return;
+
+	xx += dst->xoff;
+	yy += dst->yoff;
+
+	dx1 = MAX(dst->clip_x1 - xx, 0);
+	dy1 = MAX(dst->clip_y1 - yy, 0);
+	cw = MIN(xx + w, dst->clip_x2) - xx - dx1;
+	ch = MIN(yy + h, dst->clip_y2) - yy - dy1;
+	if (cw <= 0 || ch <= 0)
+		return;
+
+	for (cy = dy1; cy < dy1 + ch; cy ++) {
+		s = src->ptr + ((y + cy) * src->stride + x + dx1) * 4;
+		d = dst->ptr + ((yy + cy) * dst->stride + xx + dx1) * 4;
+		if (!mod && mode == PXL_BLEND_COPY)
+			memcpy(d, s, cw * 4);
+		else if (!mod)
+			blend_mode_row(s, d, cw, mode);
+		else if (mode == PXL_BLEND_COPY)
+			mod_row(s, d, cw, mod);
+		else {
+			for (cx = 0; cx < cw; cx += n) {
+				n = MIN(cw - cx, 64);
+				mod_row(s + cx * 4, row, n, mod);
+				blend_mode_row(row, d + cx * 4, n, mode);
+			}
+		}
+	}
+}
+
+/* runs of pixels if they are up to date, no side effects */
+static const unsigned char *
+pixels_spans(struct lua_pixels *hdr, int *pitch)
+{
+	struct lua_pixels *owner = hdr->parent ? hdr->parent : hdr;
+	int off;
+	if (owner->spans_ok != 1 || owner->spans_gen != owner->gen)
+		return NULL;
+	off = (hdr->img.ptr - owner->img.ptr) / 4;
+	*pitch = owner->img.w;
+	return owner->spans + (off / owner->img.stride) * owner->img.w +
+		off % owner->img.stride;
+}
+
+/* tables help blend_row only if it does not handle runs itself */
+static int
+spans_wanted(int mode)
+{
+	return mode > PXL_BLEND_BLEND || (mode == PXL_BLEND_BLEND && !blend_row_runs);
+}
+
+/* build runs for blit source into dst of mode, when it is blitted
+   twice without changes */
+static void
+pixels_spans_prepare(struct lua_pixels *hdr, int mode)
+{
+	struct lua_pixels *owner = hdr->parent ? hdr->parent : hdr;
+	if (owner->shared || !spans_wanted(mode))
+		return;
+	if (owner->spans_gen != owner->gen) {
+		owner->spans_gen = owner->gen;
+		owner->spans_ok = 0;
+		return;
+	}
+	if (owner->spans_ok)
+		return;
+	if (!owner->spans)
+		owner->spans = malloc(owner->img.w * owner->img.h);
+	if (!owner->spans)
+		return;
+	/* row kernels are faster on mixed pixels */
+	if (spans_build(&owner->img, owner->spans) * 2 >= owner->img.w * owner->img.h) {
+		owner->spans_ok = 1;
+		return;
+	}
+	free(owner->spans);
+	owner->spans = NULL;
+	owner->spans_ok = -1;
+}
+
+static void
+pixels_blit(struct lua_pixels *src, int x, int y, int w, int h,
+	img_t *dst, int xx, int yy, int flipx, int flipy)
+{
+	int pitch = 0;
+	const unsigned char *spans = NULL;
+	if (w >= SPANS_MIN && spans_wanted(dst->mode)) /* no long runs in narrow blits */
+		spans = pixels_spans(src, &pitch);
+	img_pixels_blend_flip(&src->img, x, y, w, h, dst, xx, yy,
+		flipx, flipy, spans, pitch);
+}
+
+/* {tint = color, alpha = 0-255} to multipliers, 0 if nothing to do */
+static int
+checkmod(lua_State *L, int idx, unsigned char *mod)
+{
+	color_t col = { 255, 255, 255, 255 };
+	int a;
+	if (!lua_istable(L, idx))
 		return 0;
-	return img_pixels_blend(&src->img, x, y, w, h, &dst->img, xx, yy, PXL_BLEND_COPY);
+	lua_getfield(L, idx, "tint");
+	if (!lua_isnil(L, -1))
+		checkcolor(L, lua_gettop(L), &col);
+	lua_getfield(L, idx, "alpha");
+	a = luaL_optnumber(L, -1, 255);
+	lua_pop(L, 2);
+	a = MAX(MIN(a, 255), 0);
+	mod[0] = col.r;
+	mod[1] = col.g;
+	mod[2] = col.b;
+	mod[3] = col.a * a / 255;
+	return (mod[0] & mod[1] & mod[2] & mod[3]) != 255;
 }
 
+/* PXL_BLEND_* - 1 */
+static const char *blend_modes[] = { "copy", "blend", "add", "subtract",
+	"multiply", "screen", "min", "max", NULL };
+
+/* {mode = name} to PXL_BLEND_*, 0 if there is no mode */
 static int
-pixels_blend(lua_State *L)
+checkblendmode(lua_State *L, int idx)
+{
+	int mode = 0;
+	if (!lua_istable(L, idx))
+		return 0;
+	lua_getfield(L, idx, "mode");
+	if (!lua_isnil(L, -1))
+		mode = luaL_checkoption(L, lua_gettop(L), NULL, blend_modes) + 1;
+	lua_pop(L, 1);
+	return mode;
+}
+
+static int
+pixels_blend_op(lua_State *L, int mode)
 {
-	int x = 0, y = 0, w = 0, h = 0, xx = 0, yy = 0;
+	int x = 0, y = 0, w = 0, h = 0, xx = 0, yy = 0, opt = 5, op, mods;
 	struct lua_pixels *src, *dst;
+	unsigned char mod[4];
 	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
 	dst = (struct lua_pixels*)lua_touserdata(L, 2);
 	if (!dst) {
@@ -790,54 +1225,350 @@ pixels_blend(lua_State *L)
 		dst = (struct lua_pixels*)luaL_checkudata(L, 6, "pixels metatable");
 		xx = luaL_optnumber(L, 7, 0);
 		yy = luaL_optnumber(L, 8, 0);
+		opt = 9;
 	} else {
 		xx = luaL_optnumber(L, 3, 0);
 		yy = luaL_optnumber(L, 4, 0);
 	}
 	if (dst->type != PIXELS_MAGIC)
 		return 0;
-	return img_pixels_blend(&src->img, x, y, w, h, &dst->img, xx, yy, PXL_BLEND_BLEND);
+	pixels_mark_draw(dst, xx, yy, xx + (w ? w : src->img.w) - 1,
+		yy + (h ? h : src->img.h) - 1);
+	mods = checkmod(L, opt, mod);
+	op = checkblendmode(L, opt);
+	if (mods || op) {
+		if (!op) /* blend follows the drawing mode of dst */
+			op = (mode == PXL_BLEND_BLEND) ? dst->img.mode : mode;
+		img_pixels_blend_mod(&src->img, x, y, w ? w : src->img.w,
+			h ? h : src->img.h, &dst->img, xx, yy, op, mods ? mod : NULL);
+		return 0;
+	}
+	if (mode == PXL_BLEND_COPY)
+		return img_pixels_blend(&src->img, x, y, w, h, &dst->img, xx, yy, PXL_BLEND_COPY);
+	pixels_spans_prepare(src, dst->img.mode);
+	pixels_blit(src, x, y, w ? w : src->img.w, h ? h : src->img.h,
+		&dst->img, xx, yy, 0, 0);
+	return 0;
 }
 
 static int
-pixels_expose(lua_State *L)
+pixels_copy(lua_State *L)
 {
-	int dx = 0, dy = 0, dw = 0, dh = 0;
-	struct lua_pixels *src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	return pixels_blend_op(L, PXL_BLEND_COPY);
+}
 
-	dx = luaL_optnumber(L, 2, 0);
-	dy = luaL_optnumber(L, 3, 0);
-	dw = luaL_optnumber(L, 4, src->img.w);
-	dh = luaL_optnumber(L, 5, src->img.h);
+static int
+pixels_blend(lua_State *L)
+{
+	return pixels_blend_op(L, PXL_BLEND_BLEND);
+}
 
-	WindowExpose(src->img.ptr, src->img.w, src->img.h, src->img.w * 4, dx, dy, dw, dh);
-	return 0;
+/* drawing mode of fills, filled shapes and blits onto these pixels */
+static int
+pixels_blend_mode(lua_State *L)
+{
+	int mode;
+	struct lua_pixels *hdr = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	if (!lua_isnoneornil(L, 2)) {
+		mode = luaL_checkoption(L, 2, NULL, blend_modes) + 1;
+		if (mode == PXL_BLEND_COPY) /* not a drawing mode */
+			return 0;
+		hdr->img.mode = mode;
+	}
+	lua_pushstring(L, blend_modes[hdr->img.mode - 1]);
+	return 1;
 }
 
-static __inline void
-line0(img_t *hdr, int x1, int y1, int dx, int dy, int xd, unsigned char *col, img_t *pat)
+static void
+pixels_rows_copy(unsigned char *dst, int dpitch, unsigned char *src, int spitch, int w, int h)
 {
-	int dy2 = dy * 2;
-	int dyx2 = dy2 - dx * 2;
-	int err = dy2 - dx;
-	unsigned char *ptr = NULL;
+	int y;
+	for (y = 0; y < h; y++) {
+		memcpy(dst, src, w * 4);
+		dst += dpitch;
+		src += spitch;
+	}
+}
 
-	int ly = hdr->w * 4;
-	int lx = xd * 4;
+static void
+pixels_detach(void)
+{
+	struct lua_pixels *hdr = direct_pxl;
+	if (!hdr)
+		return;
+	pixels_rows_copy(hdr->mem, hdr->img.w * 4, hdr->img.ptr, hdr->img.stride * 4,
+		hdr->img.w, hdr->img.h);
+	hdr->img.ptr = hdr->mem;
+	hdr->img.stride = hdr->img.w;
+	hdr->mem = NULL;
+	direct_pxl = NULL;
+	WindowUnlock();
+}
 
-	while ((x1 < hdr->clip_x1 || y1 < hdr->clip_y1 || x1 >= hdr->clip_x2 || y1 >= hdr->clip_y2) && dx --) {
-		if (err >= 0) {
-			y1 ++;
-			err += dyx2;
-		} else {
-			err += dy2;
-		}
-		x1 += xd;
+static int
+pixels_attach(struct lua_pixels *hdr)
+{
+	int pitch;
+	unsigned char *ptr;
+	if (direct_pxl == hdr)
+		return 0;
+	pixels_detach();
+	ptr = WindowLock(hdr->img.w, hdr->img.h, &pitch);
+	if (!ptr)
+		return -1;
+	if (pitch % 4) {
+		WindowUnlock();
+		return -1;
 	}
-	if (dx < 0)
+	pixels_rows_copy(ptr, pitch, hdr->img.ptr, hdr->img.w * 4,
+		hdr->img.w, hdr->img.h);
+	hdr->mem = hdr->img.ptr;
+	hdr->img.ptr = ptr;
+	hdr->img.stride = pitch / 4;
+	direct_pxl = hdr;
+	return 0;
+}
+
+/* start tracking changes from clean state */
+static void
+pixels_clean(struct lua_pixels *src)
+{
+	size_t size;
+	if (src->parent || src->shared)
 		return;
-	ptr = hdr->ptr;
-	ptr += (y1 * hdr->w + x1) * 4;
+	size = ((src->img.w + DIRTY_TILE - 1) / DIRTY_TILE) *
+		((src->img.h + DIRTY_TILE - 1) / DIRTY_TILE);
+	if (!src->dirty && !(src->dirty = malloc(size))) {
+		src->ndirty = -1;
+		return;
+	}
+	memset(src->dirty, 0, size);
+	src->ndirty = 0;
+}
+
+/* upload only changed tiles, runs of them row by row */
+static int
+pixels_update(struct lua_pixels *src)
+{
+	int tw, th, tx, ty, x, y, w, h;
+	unsigned char *t;
+	if (expose_last != src || !src->dirty || src->ndirty < 0)
+		return -1;
+	tw = (src->img.w + DIRTY_TILE - 1) / DIRTY_TILE;
+	th = (src->img.h + DIRTY_TILE - 1) / DIRTY_TILE;
+	for (ty = 0; ty < th && src->ndirty > 0; ty++) {
+		t = src->dirty + ty * tw;
+		for (tx = 0; tx < tw; tx++) {
+			if (!t[tx])
+				continue;
+			x = tx * DIRTY_TILE;
+			while (tx < tw && t[tx])
+				tx ++;
+			y = ty * DIRTY_TILE;
+			w = MIN(tx * DIRTY_TILE, src->img.w) - x;
+			h = MIN(y + DIRTY_TILE, src->img.h) - y;
+			if (WindowUpdate(src->img.ptr + (y * src->img.stride + x) * 4,
+				src->img.stride * 4, x, y, w, h))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* upload buffer rotated by the scroll origin, as up to four parts */
+static void
+pixels_expose_ring(struct lua_pixels *src, int dx, int dy, int dw, int dh)
+{
+	img_t *img = &src->img;
+	int rx = src->ring_x, ry = src->ring_y, w = img->w, h = img->h, y;
+	int ok = !WindowUpdate(img->ptr + (ry * img->stride + rx) * 4,
+		img->stride * 4, 0, 0, w - rx, h - ry);
+	unsigned char *buf;
+	if (ok && rx)
+		ok = !WindowUpdate(img->ptr + ry * img->stride * 4,
+			img->stride * 4, w - rx, 0, rx, h - ry);
+	if (ok && ry)
+		ok = !WindowUpdate(img->ptr + rx * 4,
+			img->stride * 4, 0, h - ry, w - rx, ry);
+	if (ok && rx && ry)
+		ok = !WindowUpdate(img->ptr, img->stride * 4, w - rx, h - ry, rx, ry);
+	if (ok) {
+		WindowExpose(NULL, w, h, 0, dx, dy, dw, dh);
+		return;
+	}
+	/* no texture yet, expose rotated copy */
+	if (!(buf = malloc(w * h * 4)))
+		return;
+	for (y = 0; y < h; y++) {
+		unsigned char *s = img->ptr + ((y + ry) % h) * img->stride * 4;
+		memcpy(buf + y * w * 4, s + rx * 4, (w - rx) * 4);
+		memcpy(buf + (y * w + w - rx) * 4, s, rx * 4);
+	}
+	WindowExpose(buf, w, h, w * 4, dx, dy, dw, dh);
+	free(buf);
+}
+
+static int
+pixels_expose(lua_State *L)
+{
+	int dx = 0, dy = 0, dw = 0, dh = 0, pitch;
+	unsigned char *ptr;
+	struct lua_pixels *src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+
+	dx = luaL_optnumber(L, 2, 0);
+	dy = luaL_optnumber(L, 3, 0);
+	dw = luaL_optnumber(L, 4, src->img.w);
+	dh = luaL_optnumber(L, 5, src->img.h);
+
+	if (src->direct && !pixels_attach(src)) {
+		/* frame is already in the texture */
+		WindowExpose(NULL, src->img.w, src->img.h, 0, dx, dy, dw, dh);
+		ptr = WindowLock(src->img.w, src->img.h, &pitch);
+		if (ptr && pitch == src->img.stride * 4) {
+			src->img.ptr = ptr;
+			expose_last = src;
+			pixels_clean(src);
+			return 0;
+		}
+		/* texture moved or is lost, go on with own memory; the
+		   frame is shown, keep it for drawing if it is readable */
+		if (ptr) {
+			pixels_rows_copy(src->mem, src->img.w * 4, ptr, pitch,
+				src->img.w, src->img.h);
+			WindowUnlock();
+		}
+		src->img.ptr = src->mem;
+		src->img.stride = src->img.w;
+		src->mem = NULL;
+		src->direct = 0;
+		direct_pxl = NULL;
+		expose_last = NULL;
+		src->ndirty = -1;
+		return 0;
+	}
+	pixels_detach();
+	if (src->ring_x || src->ring_y) {
+		pixels_expose_ring(src, dx, dy, dw, dh);
+		expose_last = NULL; /* texture is not in buffer layout */
+		pixels_clean(src);
+		return 0;
+	}
+	if (!pixels_update(src))
+		WindowExpose(NULL, src->img.w, src->img.h, 0, dx, dy, dw, dh);
+	else
+		WindowExpose(src->img.ptr, src->img.w, src->img.h, src->img.stride * 4, dx, dy, dw, dh);
+	expose_last = src;
+	pixels_clean(src);
+	return 0;
+}
+
+static int
+pixels_dirty(lua_State *L)
+{
+	int tw, th, tx, ty;
+	int x1, y1, x2 = -1, y2 = -1;
+	struct lua_pixels *src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	if (lua_toboolean(L, 2)) {
+		if (src->parent)
+			pixels_mark(src, 0, 0, src->img.w - 1, src->img.h - 1);
+		else
+			src->ndirty = -1;
+	}
+	x1 = src->img.w; y1 = src->img.h;
+	if (src->parent || !src->dirty || src->ndirty < 0 || src->shared) {
+		x1 = 0; y1 = 0;
+		x2 = src->img.w - 1; y2 = src->img.h - 1;
+	} else if (src->ndirty > 0) {
+		tw = (src->img.w + DIRTY_TILE - 1) / DIRTY_TILE;
+		th = (src->img.h + DIRTY_TILE - 1) / DIRTY_TILE;
+		for (ty = 0; ty < th; ty++) {
+			for (tx = 0; tx < tw; tx++) {
+				if (!src->dirty[ty * tw + tx])
+					continue;
+				x1 = MIN(x1, tx * DIRTY_TILE);
+				y1 = MIN(y1, ty * DIRTY_TILE);
+				x2 = MAX(x2, tx * DIRTY_TILE + DIRTY_TILE - 1);
+				y2 = MAX(y2, ty * DIRTY_TILE + DIRTY_TILE - 1);
+			}
+		}
+		x2 = MIN(x2, src->img.w - 1);
+		y2 = MIN(y2, src->img.h - 1);
+	}
+	if (x2 < x1)
+		return 0;
+	lua_pushinteger(L, x1);
+	lua_pushinteger(L, y1);
+	lua_pushinteger(L, x2 - x1 + 1);
+	lua_pushinteger(L, y2 - y1 + 1);
+	return 4;
+}
+
+static int
+pixels_direct(lua_State *L)
+{
+	struct lua_pixels *src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	if (!lua_isnoneornil(L, 2)) {
+		if (!lua_toboolean(L, 2)) {
+			if (direct_pxl == src)
+				pixels_detach();
+			src->direct = 0;
+		} else if (!src->parent && src->img.used == 1 && !src->shared &&
+			!src->ring_x && !src->ring_y) {
+			/* no views, thread copies, raw pointers and scroll origin */
+			src->direct = 1;
+		}
+	}
+	lua_pushboolean(L, src->direct);
+	return 1;
+}
+
+/*
+   Raw memory for FFI: pointer, width, height and row pitch in bytes.
+   Memory stays in place while the pixels are alive, but writes can
+   not be tracked anymore: the image is treated like a thread copy.
+*/
+static int
+pixels_ptr(lua_State *L)
+{
+	struct lua_pixels *hdr = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	struct lua_pixels *owner = hdr->parent ? hdr->parent : hdr;
+	if (direct_pxl == owner)
+		pixels_detach(); /* ptr would move on expose */
+	owner->direct = 0;
+	owner->shared = 1;
+	owner->ndirty = -1;
+	owner->gen ++;
+	lua_pushlightuserdata(L, hdr->img.ptr);
+	lua_pushinteger(L, hdr->img.w);
+	lua_pushinteger(L, hdr->img.h);
+	lua_pushinteger(L, hdr->img.stride * 4);
+	return 4;
+}
+
+static __inline void
+line0(img_t *hdr, int x1, int y1, int dx, int dy, int xd, unsigned char *col, img_t *pat)
+{
+	int dy2 = dy * 2;
+	int dyx2 = dy2 - dx * 2;
+	int err = dy2 - dx;
+	unsigned char *ptr = NULL;
+
+	int ly = hdr->stride * 4;
+	int lx = xd * 4;
+
+	while ((x1 < hdr->clip_x1 || y1 < hdr->clip_y1 || x1 >= hdr->clip_x2 || y1 >= hdr->clip_y2) && dx --) {
+		if (err >= 0) {
+			y1 ++;
+			err += dyx2;
+		} else {
+			err += dy2;
+		}
+		x1 += xd;
+	}
+	if (dx < 0)
+		return;
+	ptr = hdr->ptr;
+	ptr += (y1 * hdr->stride + x1) * 4;
 
 	pat?pixel_textured(pat, ptr, x1, y1):pixel(col, ptr);
 	while (dx --) {
@@ -866,7 +1597,7 @@ line1(img_t *hdr, int x1, int y1, int dx, int dy, int xd, unsigned char *col, im
 	int dxy2 = dx2 - dy * 2;
 	int err = dx2 - dy;
 	unsigned char *ptr = NULL;
-	int ly = hdr->w * 4;
+	int ly = hdr->stride * 4;
 	int lx = xd * 4;
 
 	while ((x1 < hdr->clip_x1 || y1 < hdr->clip_y1 || x1 >= hdr->clip_x2 || y1 >= hdr->clip_y2) && dy --) {
@@ -882,7 +1613,7 @@ line1(img_t *hdr, int x1, int y1, int dx, int dy, int xd, unsigned char *col, im
 		return;
 
 	ptr = hdr->ptr;
-	ptr += (y1 * hdr->w + x1) * 4;
+	ptr += (y1 * hdr->stride + x1) * 4;
 
 	pat?pixel_textured(pat, ptr, x1, y1):pixel(col, ptr);
 
@@ -966,17 +1697,68 @@ pixels_line(lua_State *L)
 	x2 = luaL_optnumber(L, 4, 0);
 	y2 = luaL_optnumber(L, 5, 0);
 	checkcolorpat(L, 6, &col, &pat);
+	pixels_mark_draw(src, x1, y1, x2, y2);
 	line(&src->img, x1, y1, x2, y2, &col, pat);
 	return 0;
 }
 
+static __inline void
+pixel_clip(img_t *src, unsigned char *col, int x, int y)
+{
+	if (x < src->clip_x1 || y < src->clip_y1 ||
+		x >= src->clip_x2 || y >= src->clip_y2)
+		return;
+	pixel(col, src->ptr + (y * src->stride + x) * 4);
+}
+
+/* span x1 - x2 of row y in image coordinates, clipped */
+static void
+hline(img_t *src, int x1, int x2, int y, unsigned char *col, img_t *pat)
+{
+	unsigned char *p, *pp, c[4];
+	int n, px, k;
+	if (y < src->clip_y1 || y >= src->clip_y2)
+		return;
+	x1 = MAX(x1, src->clip_x1);
+	x2 = MIN(x2, src->clip_x2 - 1);
+	if (x1 > x2)
+		return;
+	n = x2 - x1 + 1;
+	if (src->bpp == 1) { /* indexed, col[0] is the index */
+		memset(src->ptr + y * src->stride + x1, col[0], n);
+		return;
+	}
+	p = src->ptr + (y * src->stride + x1) * 4;
+	if (pat) { /* same as pixel_textured() */
+		pp = pat->ptr + (y % pat->h) * pat->stride * 4;
+		px = x1 % pat->w;
+		for (; n > 0; n -= k) {
+			k = MIN(n, pat->w - px);
+			blend_mode_row(pp + px * 4, p, k, src->mode);
+			p += k * 4;
+			px = 0;
+		}
+		return;
+	}
+	memcpy(c, col, 4); /* p does not alias it */
+	if (src->mode > PXL_BLEND_BLEND) {
+		blend_mode_fill_row(c, p, n, src->mode);
+	} else if (c[3] == 255) {
+		for (; n > 0; n --, p += 4)
+			memcpy(p, c, 4);
+	} else if (n < 8) { /* too short for row kernels */
+		for (; n > 0; n --, p += 4)
+			pixel(c, p);
+	} else
+		blend_fill_row(c, p, n);
+}
+
 static void
 lineAA(img_t *src, int x0, int y0, int x1, int y1,
 		 color_t *color)
 {
-	int dx, dy, err, e2, sx;
-	int syp, sxp, ed;
-	unsigned char *ptr;
+	int dx, dy, err, e2, sx, xp;
+	int ed;
 	unsigned char col[4] = { color->r, color->g, color->b, color->a };
 	int a = color->a;
 
@@ -990,19 +1772,12 @@ lineAA(img_t *src, int x0, int y0, int x1, int y1,
 		tmp = x0; x0 = x1; x1 = tmp;
 		tmp = y0; y0 = y1; y1 = tmp;
 	}
-	if (y1 < src->clip_y1 || y0 >= src->clip_y2)
+	/* AA pixels are one step aside */
+	if (y1 + 1 < src->clip_y1 || y0 >= src->clip_y2)
 		return;
-	if (x0 < x1) {
-		sx = 1;
-		if (x0 >= src->clip_x2 || x1 < src->clip_x1)
-			return;
-	} else {
-		sx = -1;
-		if (x1 >= src->clip_x2 || x0 < src->clip_x1)
-			return;
-	}
-	sxp = sx * 4;
-	syp = src->w * 4;
+	if (MAX(x0, x1) + 1 < src->clip_x1 || MIN(x0, x1) - 1 >= src->clip_x2)
+		return;
+	sx = (x0 < x1) ? 1 : -1;
 
 	dx =  abs(x1 - x0);
 	dy = y1 - y0;
@@ -1010,59 +1785,35 @@ lineAA(img_t *src, int x0, int y0, int x1, int y1,
 	err = dx - dy;
 	ed = dx + dy == 0 ? 1: sqrt((float)dx * dx + (float)dy * dy);
 
-	while (y0 < src->clip_y1 || x0 < src->clip_x1 || x0 >= src->clip_x2) {
-		e2 = err;
-		if (2 * e2 >= -dx) {
-			if (x0 == x1)
-				break;
-			err -= dy;
-			x0 += sx;
-		}
-		if (2 * e2 <= dy) {
-			if (y0 == y1)
-				break;
-			err += dx;
-			y0 ++;
-		}
-	}
-
-	if (y0 < src->clip_y1 || x0 < src->clip_x1 || x0 >= src->clip_x2)
-		return;
-
-	ptr = (src->ptr);
-	ptr += (y0 * src->w + x0) * 4;
-
+	/* every pixel is clipped by itself, so result does not depend on clip */
 	while (1) {
-		unsigned char *optr = ptr;
 		col[3] = a - a * abs(err - dx + dy) / ed;
-		pixel(col, ptr);
+		pixel_clip(src, col, x0, y0);
 		e2 = err;
+		xp = x0;
 		if (2 * e2 >= -dx) {
 			if (x0 == x1)
 				break;
 			if (e2 + dy < ed) {
 				col[3] = a - a * (e2 + dy) / ed;
-				pixel(col, ptr + syp);
+				pixel_clip(src, col, x0, y0 + 1);
 			}
 			err -= dy;
 			x0 += sx;
-			if (x0 < src->clip_x1 || x0 >= src->clip_x2)
-				break;
-			ptr += sxp;
 		}
 		if (2 * e2 <= dy) {
 			if (y0 == y1)
 				break;
 			if (dx - e2 < ed) {
 				col[3] = a - a * (dx - e2) / ed;
-				pixel(col, optr + sxp);
+				pixel_clip(src, col, xp + sx, y0);
 			}
 			err += dx;
 			y0 ++;
-			if (y0 >= src->clip_y2)
-				break;
-			ptr += syp;
 		}
+		if (y0 >= src->clip_y2 || (sx > 0 && x0 >= src->clip_x2) ||
+			(sx < 0 && x0 < src->clip_x1))
+			break; /* the rest is outside */
 	}
 }
 
@@ -1078,6 +1829,8 @@ pixels_lineAA(lua_State *L)
 	x2 = luaL_optnumber(L, 4, 0);
 	y2 = luaL_optnumber(L, 5, 0);
 	checkcolor(L, 6, &col);
+	pixels_mark_draw(src, MIN(x1, x2) - 1, MIN(y1, y2) - 1,
+		MAX(x1, x2) + 1, MAX(y1, y2) + 1);
 	lineAA(&src->img, x1, y1, x2, y2, &col);
 	return 0;
 }
@@ -1088,15 +1841,38 @@ orient2d(int ax, int ay, int bx, int by, int cx, int cy)
 	return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
 }
 
+static __inline long long
+floor_div(long long a, long long b, long long *rem)
+{
+	long long q = a / b;
+	if ((a % b) && (a < 0))
+		q --;
+	*rem = a - q * b;
+	return q;
+}
+
+/* narrow dx range x1 - x2 to w + a * dx >= 0, 0 if nothing is left */
+static __inline int
+edge_range(int w, int a, int *x1, int *x2)
+{
+	long long r;
+	if (a > 0)
+		*x1 = MAX(*x1, -floor_div(w, a, &r));
+	else if (a < 0)
+		*x2 = MIN(*x2, floor_div(w, -a, &r));
+	else if (w < 0)
+		return 0;
+	return *x1 <= *x2;
+}
+
+/* half-space triangle, every row is one span where all edge functions >= 0 */
 static void
 triangle(img_t *src, int x0, int y0,
 	int x1, int y1, int x2, int y2,
 	color_t *color, img_t *pat)
 {
-	int y, x, w;
-	int yd;
+	int y, xa, xb;
 	unsigned char col[4] = { color->r, color->g, color->b, color->a };
-	unsigned char *ptr;
 	int w0_row, w1_row, w2_row;
 
 	int A01, A12, A20, B01, B12, B20, minx, miny, maxx, maxy;
@@ -1117,9 +1893,6 @@ triangle(img_t *src, int x0, int y0,
 	maxx = MAX3(x0, x1, x2);
 	maxy = MAX3(y0, y1, y2);
 
-	w = src->w;
-	yd = 4 * w;
-
 	if (minx >= src->clip_x2 || miny >= src->clip_y2)
 		return;
 
@@ -1136,89 +1909,394 @@ triangle(img_t *src, int x0, int y0,
 	w1_row = orient2d(x2, y2, x0, y0, minx, miny);
 	w2_row = orient2d(x0, y0, x1, y1, minx, miny);
 
-	ptr = src->ptr + miny * yd + 4 * minx;
-
 	for (y = miny; y <= maxy; y ++) {
-		int w0 = w0_row;
-		int w1 = w1_row;
-		int w2 = w2_row;
-		unsigned char *p = ptr;
-		for (x = minx; x <= maxx; x++) {
-			if ((w0 | w1 | w2) >= 0)
-				pat?pixel_textured(pat, p, x, y):pixel(col, p);
-			p += 4;
-			w0 += A12;
-			w1 += A20;
-			w2 += A01;
-		}
+		xa = 0;
+		xb = maxx - minx;
+		if (edge_range(w0_row, A12, &xa, &xb) &&
+		    edge_range(w1_row, A20, &xa, &xb) &&
+		    edge_range(w2_row, A01, &xa, &xb))
+			hline(src, minx + xa, minx + xb, y, col, pat);
 		w0_row += B12;
 		w1_row += B20;
 		w2_row += B01;
-		ptr += yd;
 	}
 }
 
+/* vertex of textured triangle: position, texel and depth */
+struct tex_vertex {
+	int x;
+	int y;
+	float u;
+	float v;
+	float z;
+};
+
+static __inline int
+texel_wrap(float t, int size)
+{
+	int i;
+	t += 1.0f / 256; /* whole texel coordinates must not round down */
+	i = t;
+	if (t < i)
+		i --;
+	i %= size;
+	return (i < 0) ? i + size : i;
+}
+
+/*
+   Same spans as triangle(), texture coordinates are interpolated by
+   edge functions: linearly or, with depth, as u/z, v/z and 1/z.
+*/
 static void
-fill_circle(img_t *src, int xc, int yc, int radius, color_t *color, img_t *pat)
+tex_triangle(img_t *src, img_t *tex, struct tex_vertex *t, int persp)
 {
-	int r2 = radius * radius;
-	unsigned char col[4] = { color->r, color->g, color->b, color->a };
-	int x, y, xx1, xx2, yy1, yy2;
-	int w = src->w;
-	unsigned char *ptr;
-	int x1, y1, x2, y2;
+	unsigned char row[64 * 4], *d;
+	int y, x, xa, xb, n, i, area;
+	int w0_row, w1_row, w2_row, w0, w1, w2;
+	int A01, A12, A20, B01, B12, B20, minx, miny, maxx, maxy;
+	int x0 = t[0].x + src->xoff, y0 = t[0].y + src->yoff;
+	int x1 = t[1].x + src->xoff, y1 = t[1].y + src->yoff;
+	int x2 = t[2].x + src->xoff, y2 = t[2].y + src->yoff;
+	float q[3], uq[3], vq[3], u, v, w, du, dv, dw, k;
 
-	xc += src->xoff;
-	yc += src->yoff;
+	area = orient2d(x0, y0, x1, y1, x2, y2);
+	if (area <= 0)
+		return;
+	for (i = 0; i < 3; i++) {
+		q[i] = (persp && t[i].z > 0) ? 1 / t[i].z : 1;
+		uq[i] = t[i].u * q[i];
+		vq[i] = t[i].v * q[i];
+	}
 
-	x1 = src->clip_x1;
-	y1 = src->clip_y1;
-	x2 = src->clip_x2;
-	y2 = src->clip_y2;
+	A01 = y0 - y1; B01 = x1 - x0;
+	A12 = y1 - y2; B12 = x2 - x1;
+	A20 = y2 - y0; B20 = x0 - x2;
+
+	minx = MAX(MIN3(x0, x1, x2), src->clip_x1);
+	miny = MAX(MIN3(y0, y1, y2), src->clip_y1);
+	maxx = MIN(MAX3(x0, x1, x2), src->clip_x2 - 1);
+	maxy = MIN(MAX3(y0, y1, y2), src->clip_y2 - 1);
+	if (minx > maxx || miny > maxy)
+		return;
+
+	w0_row = orient2d(x1, y1, x2, y2, minx, miny);
+	w1_row = orient2d(x2, y2, x0, y0, minx, miny);
+	w2_row = orient2d(x0, y0, x1, y1, minx, miny);
+
+	k = 1.0f / area;
+	du = (A12 * uq[0] + A20 * uq[1] + A01 * uq[2]) * k;
+	dv = (A12 * vq[0] + A20 * vq[1] + A01 * vq[2]) * k;
+	dw = (A12 * q[0] + A20 * q[1] + A01 * q[2]) * k;
+
+	for (y = miny; y <= maxy; y ++, w0_row += B12, w1_row += B20, w2_row += B01) {
+		xa = 0;
+		xb = maxx - minx;
+		if (!edge_range(w0_row, A12, &xa, &xb) ||
+		    !edge_range(w1_row, A20, &xa, &xb) ||
+		    !edge_range(w2_row, A01, &xa, &xb))
+			continue;
+		w0 = w0_row + A12 * xa;
+		w1 = w1_row + A20 * xa;
+		w2 = w2_row + A01 * xa;
+		u = (w0 * uq[0] + w1 * uq[1] + w2 * uq[2]) * k;
+		v = (w0 * vq[0] + w1 * vq[1] + w2 * vq[2]) * k;
+		w = (w0 * q[0] + w1 * q[1] + w2 * q[2]) * k;
+		d = src->ptr + (y * src->stride + minx + xa) * 4;
+		for (x = xa; x <= xb; x += n) { /* texels of run, then blend */
+			n = MIN(xb - x + 1, 64);
+			for (i = 0; i < n; i++) {
+				float tu = u, tv = v;
+				if (persp) {
+					tu /= w;
+					tv /= w;
+				}
+				memcpy(row + i * 4, tex->ptr + (texel_wrap(tv, tex->h) * tex->stride +
+					texel_wrap(tu, tex->w)) * 4, 4);
+				u += du;
+				v += dv;
+				w += dw;
+			}
+			blend_mode_row(row, d, n, src->mode);
+			d += n * 4;
+		}
+	}
+}
+
+/* narrow n range a - b to 0 <= v + n * dv < lim, 0 if nothing is left */
+static __inline int
+affine_range(long long v, long long dv, long long lim, int *a, int *b)
+{
+	long long lo, hi, rem;
+	if (!dv)
+		return v >= 0 && v < lim;
+	if (dv > 0) {
+		lo = -floor_div(v, dv, &rem);
+		hi = floor_div(lim - 1 - v, dv, &rem);
+	} else {
+		lo = -floor_div(lim - 1 - v, -dv, &rem);
+		hi = floor_div(v, -dv, &rem);
+	}
+	if (lo > *a)
+		*a = (lo > *b) ? *b + 1 : lo;
+	if (hi < *b)
+		*b = (hi < *a) ? *a - 1 : hi;
+	return *a <= *b;
+}
+
+/* bounding box of the source rectangle mapped by m */
+static void
+affine_bbox(int w, int h, const float *m, int *r)
+{
+	int i;
+	float x, y, x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+	for (i = 0; i < 4; i++) {
+		float u = (i & 1) ? w : 0, v = (i & 2) ? h : 0;
+		x = m[0] * u + m[1] * v + m[2];
+		y = m[3] * u + m[4] * v + m[5];
+		if (!i || x < x1) x1 = x;
+		if (!i || x > x2) x2 = x;
+		if (!i || y < y1) y1 = y;
+		if (!i || y > y2) y2 = y;
+	}
+	r[0] = floorf(x1); r[1] = floorf(y1);
+	r[2] = ceilf(x2) - 1; r[3] = ceilf(y2) - 1;
+}
 
-	if (xc + radius < x1 || yc + radius < y1)
+/* bilinear sample at 16.16 texel position, edges are clamped;
+   colors are weighted by alpha, so transparent texels do not bleed */
+static __inline void
+texel_bilinear(img_t *tex, int u, int v, unsigned char *out)
+{
+	unsigned int wt[4], aw[4], a, r, g, b, i;
+	const unsigned char *p[4];
+	int x0, y0, x1, y1, fx, fy;
+	u -= 0x8000; v -= 0x8000;
+	x0 = u >> 16; fx = (u >> 8) & 0xff;
+	y0 = v >> 16; fy = (v >> 8) & 0xff;
+	x1 = MIN(x0 + 1, tex->w - 1); x0 = MAX(x0, 0);
+	y1 = MIN(y0 + 1, tex->h - 1); y0 = MAX(y0, 0);
+	p[0] = tex->ptr + (y0 * tex->stride + x0) * 4;
+	p[1] = tex->ptr + (y0 * tex->stride + x1) * 4;
+	p[2] = tex->ptr + (y1 * tex->stride + x0) * 4;
+	p[3] = tex->ptr + (y1 * tex->stride + x1) * 4;
+	wt[0] = (256 - fx) * (256 - fy); wt[1] = fx * (256 - fy);
+	wt[2] = (256 - fx) * fy; wt[3] = fx * fy;
+	if (p[0][3] == p[1][3] && p[0][3] == p[2][3] && p[0][3] == p[3][3]) {
+		for (i = 0; i < 4; i++)
+			out[i] = (p[0][i] * wt[0] + p[1][i] * wt[1] +
+				p[2][i] * wt[2] + p[3][i] * wt[3] + 0x8000) >> 16;
 		return;
-	if (xc - radius >= x2 || yc - radius >= y2)
+	}
+	a = r = g = b = 0;
+	for (i = 0; i < 4; i++) {
+		aw[i] = p[i][3] * wt[i];
+		a += aw[i];
+		r += p[i][0] * aw[i];
+		g += p[i][1] * aw[i];
+		b += p[i][2] * aw[i];
+	}
+	if (!a) {
+		memset(out, 0, 4);
 		return;
+	}
+	out[0] = r / a; out[1] = g / a; out[2] = b / a;
+	out[3] = (a + 0x8000) >> 16;
+}
+
+/* blend src transformed by m: source point (u, v) goes to
+   (m[0] * u + m[1] * v + m[2], m[3] * u + m[4] * v + m[5]).
+   Every destination row is sampled in 16.16 fixed point
+   only where it hits the source, then blended with blend_row */
+static void
+img_blit_affine(img_t *src, img_t *dst, const float *m, int smooth)
+{
+	unsigned char row[64 * 4], *d;
+	double det, i0, i1, i3, i4, tx, ty, fx, fy;
+	long long du, dv, lu, lv;
+	int r[4], x, y, xa, xb, n, i, u, v;
 
-	if (radius <= 0)
+	det = (double)m[0] * m[4] - (double)m[1] * m[3];
+	if (fabs(det) < 1e-9 || src->w > 0x4000 || src->h > 0x4000)
 		return;
+	i0 = m[4] / det; i1 = -m[1] / det;
+	i3 = -m[3] / det; i4 = m[0] / det;
+	tx = m[2] + dst->xoff;
+	ty = m[5] + dst->yoff;
+	du = llround(i0 * 65536); dv = llround(i3 * 65536);
+	if (llabs(du) >= 0x40000000 || llabs(dv) >= 0x40000000)
+		return; /* less than a pixel */
+
+	affine_bbox(src->w, src->h, m, r);
+	r[0] = MAX(r[0] + dst->xoff, dst->clip_x1);
+	r[1] = MAX(r[1] + dst->yoff, dst->clip_y1);
+	r[2] = MIN(r[2] + dst->xoff, dst->clip_x2 - 1);
+	r[3] = MIN(r[3] + dst->yoff, dst->clip_y2 - 1);
+
+	for (y = r[1]; y <= r[3]; y++) {
+		/* texel of pixel center (r[0], y) */
+		fx = r[0] + 0.5 - tx;
+		fy = y + 0.5 - ty;
+		lu = llround((i0 * fx + i1 * fy) * 65536);
+		lv = llround((i3 * fx + i4 * fy) * 65536);
+		xa = 0;
+		xb = r[2] - r[0];
+		if (!affine_range(lu, du, (long long)src->w << 16, &xa, &xb) ||
+		    !affine_range(lv, dv, (long long)src->h << 16, &xa, &xb))
+			continue;
+		u = lu + xa * du;
+		v = lv + xa * dv;
+		d = dst->ptr + (y * dst->stride + r[0] + xa) * 4;
+		for (x = xa; x <= xb; x += n) {
+			n = MIN(xb - x + 1, 64);
+			if (smooth) {
+				for (i = 0; i < n; i++, u += du, v += dv)
+					texel_bilinear(src, u, v, row + i * 4);
+			} else {
+				for (i = 0; i < n; i++, u += du, v += dv)
+					memcpy(row + i * 4, src->ptr +
+						((v >> 16) * src->stride + (u >> 16)) * 4, 4);
+			}
+			blend_mode_row(row, d, n, dst->mode);
+			d += n * 4;
+		}
+	}
+}
 
-	ptr = src->ptr;
-	ptr += (w * yc + xc) * 4;
+/* texel position t in 16.16 wrapped to 0 - size */
+static __inline unsigned int
+wrap_fixed(double t, int size)
+{
+	unsigned int r;
+	t = fmod(t, size);
+	if (t < 0)
+		t += size;
+	r = t * 65536;
+	return (r >= ((unsigned int)size << 16)) ? 0 : r;
+}
+
+/* mode 7 scanline: pixel x of row y shows texel (u + x * du, v + x * dv);
+   wrap repeats the texture, otherwise the edge texels are repeated */
+static void
+mode7_row(img_t *dst, int y, img_t *tex, double u, double v,
+	double du, double dv, int wrap)
+{
+	unsigned char row[64 * 4], *d;
+	int x, n, i, x1 = dst->clip_x1, x2 = dst->clip_x2;
+
+	y += dst->yoff;
+	if (y < dst->clip_y1 || y >= dst->clip_y2 || x1 >= x2)
+		return;
+	u += (x1 - dst->xoff) * du; /* first visible pixel */
+	v += (x1 - dst->xoff) * dv;
+	d = dst->ptr + (y * dst->stride + x1) * 4;
+	if (wrap) { /* one subtraction per step keeps position in range */
+		unsigned int uu = wrap_fixed(u, tex->w), vv = wrap_fixed(v, tex->h);
+		unsigned int ddu = wrap_fixed(du, tex->w), ddv = wrap_fixed(dv, tex->h);
+		unsigned int W = (unsigned int)tex->w << 16, H = (unsigned int)tex->h << 16;
+		for (x = x1; x < x2; x += n) {
+			n = MIN(x2 - x, 64);
+			for (i = 0; i < n; i++) {
+				memcpy(row + i * 4, tex->ptr +
+					((vv >> 16) * tex->stride + (uu >> 16)) * 4, 4);
+				uu += ddu;
+				if (uu >= W)
+					uu -= W;
+				vv += ddv;
+				if (vv >= H)
+					vv -= H;
+			}
+			blend_mode_row(row, d, n, dst->mode);
+			d += n * 4;
+		}
+	} else {
+		long long uu, vv, ddu, ddv;
+		int tu, tv;
+		du = MAX(MIN(du, 0x8000), -0x8000); /* further is clamped anyway */
+		dv = MAX(MIN(dv, 0x8000), -0x8000);
+		uu = llround(MAX(MIN(u, 0x40000000), -0x40000000) * 65536);
+		vv = llround(MAX(MIN(v, 0x40000000), -0x40000000) * 65536);
+		ddu = llround(du * 65536);
+		ddv = llround(dv * 65536);
+		for (x = x1; x < x2; x += n) {
+			n = MIN(x2 - x, 64);
+			for (i = 0; i < n; i++) {
+				tu = (int)MAX(MIN(uu >> 16, tex->w - 1), 0);
+				tv = (int)MAX(MIN(vv >> 16, tex->h - 1), 0);
+				memcpy(row + i * 4, tex->ptr +
+					(tv * tex->stride + tu) * 4, 4);
+				uu += ddu;
+				vv += ddv;
+			}
+			blend_mode_row(row, d, n, dst->mode);
+			d += n * 4;
+		}
+	}
+}
+
+/* last x <= x of row y inside ellipse, -1 if row is empty */
+static __inline int
+ellipse_x(int x, int y, long long rx2, long long ry2, long long lim)
+{
+	while (x >= 0 && (long long)x * x * ry2 + (long long)y * y * rx2 >= lim)
+		x --;
+	return x;
+}
+
+/* x^2 / rx^2 + y^2 / ry^2 < 1 - 1 / (rx * ry), same as old fill_circle */
+static void
+ellipse(img_t *src, int xc, int yc, int rx, int ry, color_t *color, img_t *pat,
+	int filled)
+{
+	unsigned char col[4] = { color->r, color->g, color->b, color->a };
+	long long rx2 = (long long)rx * rx;
+	long long ry2 = (long long)ry * ry;
+	long long lim = rx2 * ry2 - (long long)rx * ry;
+	int y, xm, xn, x1;
+
+	if (rx <= 0 || ry <= 0)
+		return;
+
+	xc += src->xoff;
+	yc += src->yoff;
 
-	if (radius == 1) {
-		pat?pixel_textured(pat, ptr, xc, yc):pixel(col, ptr);
-		return;
-	}
-	yy1 = -radius; yy2 = radius;
-	xx1 = -radius; xx2 = radius;
-	if (yc - radius < y1)
-		yy1 = -(yc - y1);
-	if (xc - radius < x1)
-		xx1 = -(xc - x1);
-	if (xc + radius >= x2)
-		xx2 = x2 - xc - 1;
-	if (yc + radius >= y2)
-		yy2 = y2 - yc - 1;
-	for (y = yy1; y <= yy2; y ++) {
-		unsigned char *ptrl = ptr + ((y * w + xx1) * 4);
-		for (x = xx1; x <= xx2; x++) {
-			if (x*x + y*y < r2 - 1) {
-				pat?pixel_textured(pat, ptrl, xc + x, yc + y):pixel(col, ptrl);
+	if (xc + rx < src->clip_x1 || yc + ry < src->clip_y1)
+		return;
+	if (xc - rx >= src->clip_x2 || yc - ry >= src->clip_y2)
+		return;
+
+	xm = MAX(ellipse_x(rx, 0, rx2, ry2, lim), 0); /* center at least */
+	for (y = 0; xm >= 0; y ++) {
+		xn = ellipse_x(xm, y + 1, rx2, ry2, lim);
+		x1 = (filled) ? 0 : MIN(xn + 1, xm); /* outline is the edge of fill */
+		if (x1 == 0) {
+			hline(src, xc - xm, xc + xm, yc + y, col, pat);
+			if (y)
+				hline(src, xc - xm, xc + xm, yc - y, col, pat);
+		} else {
+			hline(src, xc - xm, xc - x1, yc + y, col, pat);
+			hline(src, xc + x1, xc + xm, yc + y, col, pat);
+			if (y) {
+				hline(src, xc - xm, xc - x1, yc - y, col, pat);
+				hline(src, xc + x1, xc + xm, yc - y, col, pat);
 			}
-			ptrl += 4;
 		}
+		xm = xn;
 	}
 }
 
+static void
+fill_circle(img_t *src, int xc, int yc, int radius, color_t *color, img_t *pat)
+{
+	ellipse(src, xc, yc, radius, radius, color, pat, 1);
+}
+
 static void
 circle(img_t *src, int xc, int yc, int rr, color_t *color, img_t *pat)
 {
 	int x = -rr, y = 0, err = 2 - 2 * rr;
 	unsigned char col[4] = { color->r, color->g, color->b, color->a };
 	unsigned char *ptr = src->ptr;
-	int w = src->w;
+	int w = src->stride;
 	int x1, y1, x2, y2;
 
 	if (rr <= 0)
@@ -1289,71 +2367,38 @@ circle(img_t *src, int xc, int yc, int rr, color_t *color, img_t *pat)
 static void
 circleAA(img_t *src, int xc, int yc, int rr, color_t *color)
 {
-	int p1, p2, p3, p4;
 	int x = -rr, y = 0, xx2, e2, err = 2 - 2 * rr;
-	unsigned char *ptr = src->ptr;
 	unsigned char col[4] = { color->r, color->g, color->b, color->a };
 	int a = color->a;
 
-	int w = src->w;
-	int x1, y1, x2, y2;
-
 	xc += src->xoff;
 	yc += src->yoff;
 
-	x1 = src->clip_x1;
-	y1 = src->clip_y1;
-	x2 = src->clip_x2;
-	y2 = src->clip_y2;
-
 	if (rr <= 0)
 		return;
-	if (xc + rr < x1 || yc + rr < y1)
+	/* AA pixels are one step aside */
+	if (xc + rr + 1 < src->clip_x1 || yc + rr + 1 < src->clip_y1)
 		return;
-	if (xc - rr >= x2 || yc - rr >= y2)
+	if (xc - rr - 1 >= src->clip_x2 || yc - rr - 1 >= src->clip_y2)
 		return;
 	rr = 1 - err;
-	ptr += (w * yc + xc) * 4;
 	do {
 		int i = 255 * abs(err - 2 *(x + y)-2) / rr;
-		int xmy = (x - y * w) * 4;
-		int yax = (y + x * w) * 4;
 		col[3] = ((255 - i) * a) >> 8;
-		p1 = 0; p2 = 0; p3 = 0; p4 = 0;
-		if (((xc - x - x1) | (x2 - xc + x - 1) |
-		     (yc + y - y1) | (y2 - yc - y - 1)) >= 0) {
-			pixel(col, ptr - xmy);
-			p1 = 1;
-		}
-		if (((xc - y - x1) | (x2 - xc + y - 1) |
-		     (yc - x - y1) | (y2 - yc + x - 1)) >= 0) {
-			pixel(col, ptr - yax);
-			p2 = 1;
-		}
-		if (((xc + x - x1) | (x2 - xc - x - 1) |
-		     (yc - y - y1) | (y2 - yc + y - 1)) >= 0) {
-			pixel(col, ptr + xmy);
-			p3 = 1;
-		}
-		if (((xc + y - x1) | (x2 - xc - y - 1) |
-		     (yc + x - y1) | (y2 - yc - x - 1)) >= 0) {
-			pixel(col, ptr + yax);
-			p4 = 1;
-		}
+		pixel_clip(src, col, xc - x, yc + y);
+		pixel_clip(src, col, xc - y, yc - x);
+		pixel_clip(src, col, xc + x, yc - y);
+		pixel_clip(src, col, xc + y, yc + x);
 		e2 = err;
 		xx2 = x;
 		if (err + y > 0) {
 			i = 255 * (err - 2 * x - 1) / rr;
 			if (i < 256) {
 				col[3] = ((255 - i) * a) >> 8;
-				if (p1 && yc + y + 1 < y2)
-					pixel(col, ptr - xmy + w * 4);
-				if (p2 && xc - y - 1 >= x1)
-					pixel(col, ptr - yax - 4);
-				if (p3 && yc - y - 1 >= y1)
-					pixel(col, ptr + xmy - w * 4);
-				if (p4 && xc + y < x2)
-					pixel(col, ptr + yax + 4);
+				pixel_clip(src, col, xc - x, yc + y + 1);
+				pixel_clip(src, col, xc - y - 1, yc - x);
+				pixel_clip(src, col, xc + x, yc - y - 1);
+				pixel_clip(src, col, xc + y + 1, yc + x);
 			}
 			err += ++x * 2 + 1;
 		}
@@ -1361,103 +2406,369 @@ circleAA(img_t *src, int xc, int yc, int rr, color_t *color)
 			i = 255 * (2 * y + 3 - e2) / rr;
 			if (i < 256) {
 				col[3] = ((255 - i) * a) >> 8;
-				if (p1 && xc - xx2 - 1 >= x1)
-					pixel(col, ptr - xmy - 4);
-				if (p2 && yc - xx2 - 1 >= y1)
-					pixel(col, ptr - yax - w * 4);
-				if (p3 && xc + xx2 + 1 < x2)
-					pixel(col, ptr + xmy + 4);
-				if (p4 && yc + xx2 + 1 < y2)
-					pixel(col, ptr + yax + w * 4);
+				pixel_clip(src, col, xc - xx2 - 1, yc + y);
+				pixel_clip(src, col, xc - y, yc - xx2 - 1);
+				pixel_clip(src, col, xc + xx2 + 1, yc - y);
+				pixel_clip(src, col, xc + y, yc + xx2 + 1);
 			}
 			err += ++y * 2 + 1;
 		}
 	} while (x < 0);
 }
 
-struct lua_point {
+/* scratch memory of lua state, reused by calls */
+struct scratch {
+	void *ptr;
+	size_t size;
+};
+
+static int
+scratch_gc(lua_State *L)
+{
+	struct scratch *s = (struct scratch*)lua_touserdata(L, 1);
+	free(s->ptr);
+	s->ptr = NULL;
+	s->size = 0;
+	return 0;
+}
+
+static void *
+scratch_get(lua_State *L, size_t size)
+{
+	struct scratch *s;
+	void *p;
+	lua_getfield(L, LUA_REGISTRYINDEX, "gfx scratch");
+	s = (struct scratch*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!s) {
+		s = lua_newuserdata(L, sizeof(*s));
+		s->ptr = NULL;
+		s->size = 0;
+		lua_newtable(L);
+		lua_pushcfunction(L, scratch_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, "gfx scratch");
+	}
+	if (s->size >= size)
+		return s->ptr;
+	p = realloc(s->ptr, size);
+	if (!p)
+		return NULL;
+	s->ptr = p;
+	s->size = size;
+	return p;
+}
+
+/* polygon edge, x of row y is x0 + trunc((y - y0) * dx / dy) */
+struct edge {
+	int y1; /* first and last rows */
+	int y2;
+	int dir; /* winding */
+	int x0;
+	int y0;
+	int dx;
+	int dy; /* > 0 */
+	int q; /* floor quotient and remainder of (y - y0) * dx / dy */
+	int rem;
+	int dq; /* their steps per row */
+	int drem;
 	int x;
-	int y;
-	int nodex;
 };
 
+static void
+edge_at(struct edge *e, int y)
+{
+	long long r;
+	e->q = floor_div((long long)(y - e->y0) * e->dx, e->dy, &r);
+	e->rem = r;
+}
+
+static int
+edge_cmp(const void *a, const void *b)
+{
+	return ((const struct edge *)a)->y1 - ((const struct edge *)b)->y1;
+}
+
+/* scanlines y1 < y < y2 of polygon, spans from x of one edge to x of next */
+static void
+fill_poly(img_t *src, int *v, int nr, unsigned char *col, img_t *pat,
+	int nonzero, void *mem)
+{
+	struct edge *edges = mem, *e, **act;
+	int i, j, k, n = 0, na = 0, y, y1, y2, dx, dy, wind;
+	long long r;
+
+	act = (struct edge **)(edges + nr);
+	y1 = y2 = v[1];
+	for (i = 0, j = nr - 1; i < nr; j = i ++) {
+		y1 = MIN(y1, v[i * 2 + 1]);
+		y2 = MAX(y2, v[i * 2 + 1]);
+		dy = v[i * 2 + 1] - v[j * 2 + 1];
+		if (!dy)
+			continue;
+		dx = v[i * 2] - v[j * 2];
+		e = &edges[n ++];
+		e->dir = (dy > 0) ? 1 : -1;
+		e->y1 = MIN(v[i * 2 + 1], v[j * 2 + 1]) + 1;
+		e->y2 = MAX(v[i * 2 + 1], v[j * 2 + 1]);
+		if (dy < 0) { /* keep dy positive */
+			dx = -dx;
+			dy = -dy;
+		}
+		e->x0 = v[i * 2];
+		e->y0 = v[i * 2 + 1];
+		e->dx = dx;
+		e->dy = dy;
+		e->dq = floor_div(dx, dy, &r);
+		e->drem = r;
+	}
+	qsort(edges, n, sizeof(*edges), edge_cmp);
+	y = MAX(y1 + 1, src->clip_y1);
+	y2 = MIN(y2, src->clip_y2);
+	for (k = 0; y < y2; y ++) {
+		for (i = 0, j = 0; i < na; i++) { /* remove finished */
+			if (act[i]->y2 >= y)
+				act[j ++] = act[i];
+		}
+		na = j;
+		for (; k < n && edges[k].y1 <= y; k++) { /* add started */
+			e = &edges[k];
+			if (e->y2 < y)
+				continue;
+			edge_at(e, y);
+			act[na ++] = e;
+		}
+		for (i = 0; i < na; i++) { /* x, sorted by insertion */
+			e = act[i];
+			e->x = e->x0 + e->q + (e->q < 0 && e->rem);
+			for (j = i; j > 0 && act[j - 1]->x > e->x; j--)
+				act[j] = act[j - 1];
+			act[j] = e;
+		}
+		for (i = 0, wind = 0; i + 1 < na; i++) {
+			if (nonzero)
+				wind += act[i]->dir;
+			else
+				wind ^= 1;
+			if (wind)
+				hline(src, act[i]->x, act[i + 1]->x - 1, y, col, pat);
+		}
+		for (i = 0; i < na; i++) { /* next row */
+			e = act[i];
+			e->q += e->dq;
+			e->rem += e->drem;
+			if (e->rem >= e->dy) {
+				e->q ++;
+				e->rem -= e->dy;
+			}
+		}
+	}
+}
+
 /*
-   http://alienryderflex.com/polygon_fill/
-   public-domain code by Darel Rex Finley, 2007
+   Anti-aliased fills: every edge adds signed area it covers in a row to
+   accumulation buffer, running sum of the row is the coverage of pixel
+   (nonzero rule). Same as new stb_truetype rasterizer and font-rs.
+   Vertices are pixel centers, as in lineAA.
 */
+struct aa_edge {
+	float x0;
+	float y0; /* y0 < y1 */
+	float y1;
+	float dxdy;
+	float dir;
+};
+
+static int
+aa_edge_cmp(const void *a, const void *b)
+{
+	float d = ((const struct aa_edge *)a)->y0 - ((const struct aa_edge *)b)->y0;
+	return (d > 0) - (d < 0);
+}
+
+static __inline void
+acc_add(float *acc, int w, int x, float v)
+{
+	if (x < 0)
+		x = 0;
+	if (x <= w)
+		acc[x] += v;
+}
+
+/* area of edge part in row y, x is relative to acc */
+static void
+aa_edge_row(float *acc, int w, struct aa_edge *e, int y, int xs)
+{
+	float ya = MAX(y, e->y0), yb = MIN(y + 1, e->y1);
+	float dy = yb - ya, d = dy * e->dir;
+	float x = e->x0 + (ya - e->y0) * e->dxdy - xs;
+	float xn = x + e->dxdy * dy;
+	float x0 = MIN(x, xn), x1 = MAX(x, xn);
+	float xmf, s, x0f, x1f, a0, a1, a2, am;
+	int x0i, x1i, xi, xe;
+
+	if (dy <= 0)
+		return;
+	if (x1 <= 0) { /* left of the buffer, whole area is to the right */
+		acc[0] += d;
+		return;
+	}
+	if (x0 >= w + 1)
+		return;
+	x0i = floorf(x0);
+	x1i = ceilf(x1);
+	if (x1i <= x0i + 1) {
+		xmf = 0.5f * (x + xn) - x0i;
+		acc_add(acc, w, x0i, d - d * xmf);
+		acc_add(acc, w, x0i + 1, d * xmf);
+		return;
+	}
+	s = 1.0f / (x1 - x0);
+	x0f = x0 - x0i;
+	a0 = 0.5f * s * (1 - x0f) * (1 - x0f);
+	x1f = x1 - x1i + 1;
+	am = 0.5f * s * x1f * x1f;
+	acc_add(acc, w, x0i, d * a0);
+	if (x1i == x0i + 2) {
+		acc_add(acc, w, x0i + 1, d * (1 - a0 - am));
+	} else {
+		a1 = s * (1.5f - x0f);
+		acc_add(acc, w, x0i + 1, d * (a1 - a0));
+		xi = x0i + 2;
+		if (xi < 0) { /* skip columns left of the buffer */
+			xe = MIN(x1i - 1, 0);
+			acc[0] += d * s * (xe - xi);
+			xi = xe;
+		}
+		for (xe = MIN(x1i - 1, w + 1); xi < xe; xi++)
+			acc[xi] += d * s;
+		a2 = a1 + (x1i - x0i - 3) * s;
+		acc_add(acc, w, x1i - 1, d * (1 - a2 - am));
+	}
+	acc_add(acc, w, x1i, d * am);
+}
 
+/* coverage of row y to pixels, full runs go to the span filler */
 static void
-fill_poly(img_t *src, struct lua_point *v, int nr, unsigned char *col, img_t *pat)
+aa_row(img_t *src, float *acc, int w, int xs, int y, unsigned char *col, img_t *pat)
 {
-	unsigned char *ptr = src->ptr, *ptr1;
-	int y, x, xmin, xmax, ymin, ymax, swap, w;
-	int nodes = 0, j, i;
-	xmin = v[0].x; xmax = v[0].x;
-	ymin = v[0].y; ymax = v[0].y;
+	unsigned char c[4], *d;
+	float sum = 0;
+	int x, a = 0, run = -1;
+	d = src->ptr + (y * src->stride + xs) * 4;
+	for (x = 0; x < w; x++, d += 4) {
+		if (acc[x] != 0) { /* coverage is changed */
+			sum += acc[x];
+			acc[x] = 0;
+			a = fabsf(sum) * 255 + 0.5f;
+		}
+		if (a >= 255) {
+			if (run < 0)
+				run = x;
+			continue;
+		}
+		if (run >= 0) {
+			hline(src, xs + run, xs + x - 1, y, col, pat);
+			run = -1;
+		}
+		if (a <= 0)
+			continue;
+		if (pat)
+			memcpy(c, pat->ptr + ((y % pat->h) * pat->stride +
+				(xs + x) % pat->w) * 4, 4);
+		else
+			memcpy(c, col, 4);
+		c[3] = c[3] * a / 255;
+		if (src->mode > PXL_BLEND_BLEND) /* edges as the spans */
+			blend_op_row(c, d, 1, src->mode);
+		else
+			pixel(c, d);
+	}
+	if (run >= 0)
+		hline(src, xs + run, xs + w - 1, y, col, pat);
+	acc[w] = 0;
+	acc[w + 1] = 0;
+}
 
-	for (i = 0; i < nr; i++) {
-		if (v[i].x < xmin)
-			xmin = v[i].x;
-		if (v[i].x > xmax)
-			xmax = v[i].x;
-		if (v[i].y < ymin)
-			ymin = v[i].y;
-		if (v[i].y > ymax)
-			ymax = v[i].y;
-	}
-	if (ymin < src->clip_y1)
-		ymin = src->clip_y1;
-	if (xmin < src->clip_x1)
-		xmin = src->clip_x1;
-	if (xmax >= src->clip_x2)
-		xmax = src->clip_x2;
-	if (ymax >= src->clip_y2)
-		ymax = src->clip_y2;
-	ptr += (ymin * src->w) * 4;
-	for (y = ymin; y < ymax; y ++) {
-		nodes = 0; j = nr - 1;
-		for (i = 0; i < nr; i++) {
-			if ((v[i].y < y && v[j].y >= y) ||
-			    (v[j].y < y && v[i].y >= y)) {
-				v[nodes ++].nodex = v[i].x + ((y - v[i].y) * (v[j].x - v[i].x)) /
-					(v[j].y - v[i].y);
-			}
-			j = i;
+/* mem: nr pointers, nr aa_edge and src->w + 2 floats, pointers
+   first to stay aligned */
+static void
+fill_polyAA(img_t *src, float *v, int nr, unsigned char *col, img_t *pat,
+	void *mem)
+{
+	struct aa_edge *edges, *e, **act = mem;
+	float *acc, x1, y1, x2, y2, xa, ya, xb, yb;
+	int i, j, k, n = 0, na = 0, y, ys, ye, xs, xe;
+
+	edges = (struct aa_edge *)(act + nr);
+	acc = (float *)(edges + nr);
+	x1 = x2 = v[0];
+	y1 = y2 = v[1];
+	for (i = 0, j = nr - 1; i < nr; j = i ++) {
+		xa = v[j * 2] + 0.5f; ya = v[j * 2 + 1] + 0.5f;
+		xb = v[i * 2] + 0.5f; yb = v[i * 2 + 1] + 0.5f;
+		x1 = MIN(x1, xb); x2 = MAX(x2, xb);
+		y1 = MIN(y1, yb); y2 = MAX(y2, yb);
+		if (ya == yb)
+			continue;
+		e = &edges[n ++];
+		e->dir = (yb > ya) ? 1 : -1;
+		if (ya > yb) {
+			e->x0 = xb; e->y0 = yb; e->y1 = ya;
+		} else {
+			e->x0 = xa; e->y0 = ya; e->y1 = yb;
 		}
-		if (nodes < 2)
-			goto skip;
-		i = 0;
-		while (i < nodes - 1) { /* sort */
-			if (v[i].nodex > v[i + 1].nodex) {
-				swap = v[i].nodex;
-				v[i].nodex = v[i + 1].nodex;
-				v[i + 1].nodex = swap;
-				if (i)
-					i --;
-			} else {
-				i ++;
-			}
+		e->dxdy = (xb - xa) / (yb - ya);
+	}
+	ys = MAX((int)floorf(y1), src->clip_y1);
+	ye = MIN((int)ceilf(y2), src->clip_y2);
+	xs = MAX((int)floorf(x1), src->clip_x1);
+	xe = MIN((int)ceilf(x2), src->clip_x2);
+	if (ys >= ye || xs >= xe)
+		return;
+	memset(acc, 0, (xe - xs + 2) * sizeof(float));
+	if (n > 32)
+		qsort(edges, n, sizeof(*edges), aa_edge_cmp);
+	for (i = 1; n <= 32 && i < n; i++) { /* few edges, insertion is faster */
+		struct aa_edge t = edges[i];
+		for (j = i; j > 0 && edges[j - 1].y0 > t.y0; j--)
+			edges[j] = edges[j - 1];
+		edges[j] = t;
+	}
+	for (k = 0, y = ys; y < ye; y ++) {
+		for (i = 0, j = 0; i < na; i++) { /* remove finished */
+			if (act[i]->y1 > y)
+				act[j ++] = act[i];
 		}
-		for (i = 0; i < nodes; i += 2) {
-			if (v[i].nodex >= xmax)
-				break;
-			if (v[i + 1].nodex > xmin) {
-				if (v[i].nodex < xmin)
-					v[i].nodex = xmin;
-				if (v[i + 1].nodex > xmax)
-					v[i + 1].nodex = xmax;
-				// hline
-				w = (v[i + 1].nodex - v[i].nodex);
-				swap = v[i].nodex;
-				ptr1 = ptr + swap * 4;
-				for (x = 0; x < w; x ++) {
-					pat?pixel_textured(pat, ptr1, swap + x, y):pixel(col, ptr1);
-					ptr1 += 4;
-				}
-			}
+		na = j;
+		for (; k < n && edges[k].y0 < y + 1; k++) { /* add started */
+			if (edges[k].y1 > y)
+				act[na ++] = &edges[k];
 		}
-	skip:
-		ptr += src->w * 4;
+		for (i = 0; i < na; i++)
+			aa_edge_row(acc, xe - xs, act[i], y, xs);
+		aa_row(src, acc, xe - xs, xs, y, col, pat);
+	}
+}
+
+/* circle as polygon, error of segments is less than 0.1 pixel;
+   capped so a huge radius can not blow up the scratch */
+#define CIRCLE_SEGS(r) MIN(MAX(8, (int)(7 * sqrtf(MIN(r, 1e6f)))), 4096)
+
+static void
+circle_poly(float *v, int nr, float xc, float yc, float r)
+{
+	int i;
+	float a = 2 * 3.14159265f / nr, c = cosf(a), s = sinf(a), x, y;
+	x = r * sqrtf(a / s); /* same area as circle */
+	y = 0;
+	for (i = 0; i < nr; i++) { /* rotate by a */
+		v[i * 2] = xc + x;
+		v[i * 2 + 1] = yc + y;
+		r = x * c - y * s;
+		y = x * s + y * c;
+		x = r;
 	}
 }
 
@@ -1482,12 +2793,38 @@ pixels_triangle(lua_State *L)
 	}
 	#undef XOR_SWAP
 	checkcolorpat(L, 8, &col, &pat);
-
+	pixels_mark_draw(src, MIN3(x0, x1, x2), MIN3(y0, y1, y2),
+		MAX3(x0, x1, x2), MAX3(y0, y1, y2));
 	triangle(&src->img, x0, y0, x1, y1, x2, y2,
 		&col, pat);
 	return 0;
 }
 
+static int
+pixels_tex_triangle(lua_State *L)
+{
+	struct lua_pixels *src, *tex;
+	struct tex_vertex t[3], tmp;
+	int i, persp;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	tex = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	persp = lua_isnumber(L, 15);
+	for (i = 0; i < 3; i++) {
+		t[i].x = luaL_checknumber(L, 3 + i * 4);
+		t[i].y = luaL_checknumber(L, 4 + i * 4);
+		t[i].u = luaL_checknumber(L, 5 + i * 4);
+		t[i].v = luaL_checknumber(L, 6 + i * 4);
+		t[i].z = (persp) ? luaL_checknumber(L, 15 + i) : 1;
+	}
+	if (orient2d(t[0].x, t[0].y, t[1].x, t[1].y, t[2].x, t[2].y) < 0) {
+		tmp = t[1]; t[1] = t[2]; t[2] = tmp;
+	}
+	pixels_mark_draw(src, MIN3(t[0].x, t[1].x, t[2].x), MIN3(t[0].y, t[1].y, t[2].y),
+		MAX3(t[0].x, t[1].x, t[2].x), MAX3(t[0].y, t[1].y, t[2].y));
+	tex_triangle(&src->img, &tex->img, t, persp);
+	return 0;
+}
+
 static int
 pixels_circle(lua_State *L)
 {
@@ -1500,6 +2837,7 @@ pixels_circle(lua_State *L)
 	yc = luaL_optnumber(L, 3, 0);
 	rr = luaL_optnumber(L, 4, 0);
 	checkcolorpat(L, 5, &col, &pat);
+	pixels_mark_draw(src, xc - rr, yc - rr, xc + rr, yc + rr);
 	circle(&src->img, xc, yc, rr, &col, pat);
 	return 0;
 }
@@ -1515,6 +2853,7 @@ pixels_circleAA(lua_State *L)
 	yc = luaL_optnumber(L, 3, 0);
 	rr = luaL_optnumber(L, 4, 0);
 	checkcolor(L, 5, &col);
+	pixels_mark_draw(src, xc - rr - 1, yc - rr - 1, xc + rr + 1, yc + rr + 1);
 	circleAA(&src->img, xc, yc, rr, &col);
 	return 0;
 }
@@ -1531,51 +2870,185 @@ pixels_fill_circle(lua_State *L)
 	yc = luaL_optnumber(L, 3, 0);
 	rr = luaL_optnumber(L, 4, 0);
 	checkcolorpat(L, 5, &col, &pat);
+	pixels_mark_draw(src, xc - rr, yc - rr, xc + rr, yc + rr);
 	fill_circle(&src->img, xc, yc, rr,
 		&col, pat);
 	return 0;
 }
 
+static int
+pixels_ellipse_op(lua_State *L, int filled)
+{
+	int xc = 0, yc = 0, rx = 0, ry = 0;
+	color_t col;
+	struct lua_pixels *src;
+	img_t *pat;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	xc = luaL_optnumber(L, 2, 0);
+	yc = luaL_optnumber(L, 3, 0);
+	rx = luaL_optnumber(L, 4, 0);
+	ry = luaL_optnumber(L, 5, 0);
+	checkcolorpat(L, 6, &col, &pat);
+	pixels_mark_draw(src, xc - rx, yc - ry, xc + rx, yc + ry);
+	ellipse(&src->img, xc, yc, rx, ry, &col, pat, filled);
+	return 0;
+}
+
+static int
+pixels_ellipse(lua_State *L)
+{
+	return pixels_ellipse_op(L, 0);
+}
+
+static int
+pixels_fill_ellipse(lua_State *L)
+{
+	return pixels_ellipse_op(L, 1);
+}
+
+/* vertices of table idx in image coordinates, after the room
+   fill_poly needs in *mem; bounding box to r, 0 if no polygon */
+static int
+poly_vertices(lua_State *L, int idx, img_t *img, int **pv, void **mem, int *r)
+{
+	int nr, i, *v;
+	nr = lua_rawlen(L, idx) / 2;
+	if (nr < 3)
+		return 0;
+	*mem = scratch_get(L, nr * (sizeof(struct edge) +
+		sizeof(struct edge *) + 2 * sizeof(int)));
+	if (!*mem)
+		return 0;
+	v = *pv = (int *)((struct edge **)((struct edge *)*mem + nr) + nr);
+	for (i = 0; i < nr * 2; i += 2) {
+		lua_rawgeti(L, idx, i + 1);
+		lua_rawgeti(L, idx, i + 2);
+		v[i] = lua_tonumber(L, -2) + img->xoff;
+		v[i + 1] = lua_tonumber(L, -1) + img->yoff;
+		lua_pop(L, 2);
+	}
+	r[0] = r[2] = v[0];
+	r[1] = r[3] = v[1];
+	for (i = 2; i < nr * 2; i += 2) {
+		r[0] = MIN(r[0], v[i]); r[2] = MAX(r[2], v[i]);
+		r[1] = MIN(r[1], v[i + 1]); r[3] = MAX(r[3], v[i + 1]);
+	}
+	return nr;
+}
+
+/* fill rule of fill_poly, index is the nonzero flag */
+static const char *fill_rules[] = { "evenodd", "nonzero", NULL };
+
 static int
 pixels_fill_poly(lua_State *L)
+{
+	int nr, r[4], *v, nonzero;
+	struct lua_pixels *src;
+	img_t *pat;
+	unsigned char col[4];
+	color_t color;
+	void *mem;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	checkcolorpat(L, 3, &color, &pat);
+	nonzero = luaL_checkoption(L, 4, "evenodd", fill_rules);
+	col[0] = color.r;
+	col[1] = color.g;
+	col[2] = color.b;
+	col[3] = color.a;
+
+	nr = poly_vertices(L, 2, &src->img, &v, &mem, r);
+	if (!nr)
+		return 0;
+	pixels_mark(src, r[0], r[1], r[2], r[3]);
+	fill_poly(&src->img, v, nr, col, pat, nonzero, mem);
+	return 0;
+}
+
+static int
+pixels_fill_polyAA(lua_State *L)
 {
 	int nr, i;
+	float *v, x1, y1, x2, y2;
 	struct lua_pixels *src;
-	struct lua_point *v;
 	img_t *pat;
 	unsigned char col[4];
 	color_t color;
+	void *mem;
 	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
 	luaL_checktype(L, 2, LUA_TTABLE);
 	nr = lua_rawlen(L, 2);
 	if (nr < 6)
 		return 0;
 	checkcolorpat(L, 3, &color, &pat);
-	if (!pat) {
-		col[0] = color.r;
-		col[1] = color.g;
-		col[2] = color.b;
-		col[3] = color.a;
-	}
+	col[0] = color.r;
+	col[1] = color.g;
+	col[2] = color.b;
+	col[3] = color.a;
 
 	nr /= 2;
-	v = malloc(sizeof(*v) * nr);
-	if (!v)
+	mem = scratch_get(L, nr * (sizeof(struct aa_edge) +
+		sizeof(struct aa_edge *) + 2 * sizeof(float)) +
+		(src->img.w + 2) * sizeof(float));
+	if (!mem)
 		return 0;
-	lua_pushvalue(L, 2);
-	for (i = 0; i < nr; i++) {
-		lua_pushinteger(L, (i * 2) + 1);
-		lua_gettable(L, -2);
-		v[i].x = lua_tonumber(L, -1) + src->img.xoff;
-		lua_pop(L, 1);
-		lua_pushinteger(L, (i * 2) + 2);
-		lua_gettable(L, -2);
-		v[i].y = lua_tonumber(L, -1) + src->img.yoff;
-		lua_pop(L, 1);
+	v = (float *)((struct aa_edge *)((struct aa_edge **)mem + nr) + nr) +
+		src->img.w + 2;
+	for (i = 0; i < nr * 2; i += 2) {
+		lua_rawgeti(L, 2, i + 1);
+		lua_rawgeti(L, 2, i + 2);
+		v[i] = lua_tonumber(L, -2) + src->img.xoff;
+		v[i + 1] = lua_tonumber(L, -1) + src->img.yoff;
+		lua_pop(L, 2);
 	}
-	lua_pop(L, 1);
-	fill_poly(&src->img, v, nr, col, pat);
-	free(v);
+	x1 = x2 = v[0];
+	y1 = y2 = v[1];
+	for (i = 2; i < nr * 2; i += 2) {
+		x1 = MIN(x1, v[i]); x2 = MAX(x2, v[i]);
+		y1 = MIN(y1, v[i + 1]); y2 = MAX(y2, v[i + 1]);
+	}
+	pixels_mark(src, floorf(x1), floorf(y1), ceilf(x2), ceilf(y2));
+	fill_polyAA(&src->img, v, nr, col, pat, mem);
+	return 0;
+}
+
+static int
+pixels_fill_circleAA(lua_State *L)
+{
+	int nr;
+	float xc, yc, rr, *v;
+	struct lua_pixels *src;
+	img_t *pat;
+	unsigned char col[4];
+	color_t color;
+	void *mem;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	xc = luaL_optnumber(L, 2, 0);
+	yc = luaL_optnumber(L, 3, 0);
+	rr = luaL_optnumber(L, 4, 0);
+	checkcolorpat(L, 5, &color, &pat);
+	if (!(rr > 0)) /* NaN too */
+		return 0;
+	if (xc + src->img.xoff + rr + 1 < src->img.clip_x1 ||
+	    yc + src->img.yoff + rr + 1 < src->img.clip_y1 ||
+	    xc + src->img.xoff - rr - 1 >= src->img.clip_x2 ||
+	    yc + src->img.yoff - rr - 1 >= src->img.clip_y2)
+		return 0;
+	col[0] = color.r;
+	col[1] = color.g;
+	col[2] = color.b;
+	col[3] = color.a;
+	nr = CIRCLE_SEGS(rr);
+	mem = scratch_get(L, nr * (sizeof(struct aa_edge) +
+		sizeof(struct aa_edge *) + 2 * sizeof(float)) +
+		(src->img.w + 2) * sizeof(float));
+	if (!mem)
+		return 0;
+	v = (float *)((struct aa_edge *)((struct aa_edge **)mem + nr) + nr) +
+		src->img.w + 2;
+	pixels_mark_draw(src, floorf(xc - rr), floorf(yc - rr), ceilf(xc + rr), ceilf(yc + rr));
+	circle_poly(v, nr, xc + src->img.xoff, yc + src->img.yoff, rr);
+	fill_polyAA(&src->img, v, nr, col, pat, mem);
 	return 0;
 }
 
@@ -1583,6 +3056,7 @@ static int
 _pixels_poly(lua_State *L, int aa)
 {
 	int nr, i, x0, y0, x1, y1, x2, y2;
+	int xmin = 0, ymin = 0, xmax = 0, ymax = 0;
 	img_t *pat;
 	struct lua_pixels *src;
 	color_t color;
@@ -1593,18 +3067,15 @@ _pixels_poly(lua_State *L, int aa)
 		return 0;
 	checkcolorpat(L, 3, &color, &pat);
 	nr /= 2;
-	lua_pushvalue(L, 2);
 	for (i = 0; i < nr; i++) {
-		lua_pushinteger(L, (i * 2) + 1);
-		lua_gettable(L, -2);
+		lua_rawgeti(L, 2, (i * 2) + 1);
 		x2 = lua_tonumber(L, -1) + src->img.xoff;
 		lua_pop(L, 1);
-		lua_pushinteger(L, (i * 2) + 2);
-		lua_gettable(L, -2);
+		lua_rawgeti(L, 2, (i * 2) + 2);
 		y2 = lua_tonumber(L, -1) + src->img.yoff;
 		if (i == 0) {
-			x0 = x2;
-			y0 = y2;
+			x0 = xmin = xmax = x2;
+			y0 = ymin = ymax = y2;
 		} else {
 			(aa)?lineAA(&src->img, x1, y1, x2, y2, &color):
 				line(&src->img, x1, y1, x2, y2, &color, pat);
@@ -1615,9 +3086,12 @@ _pixels_poly(lua_State *L, int aa)
 		}
 		x1 = x2;
 		y1 = y2;
+		xmin = MIN(xmin, x2); xmax = MAX(xmax, x2);
+		ymin = MIN(ymin, y2); ymax = MAX(ymax, y2);
 		lua_pop(L, 1);
 	}
-	lua_pop(L, 1);
+	/* lines add the offset once more */
+	pixels_mark_draw(src, xmin - aa, ymin - aa, xmax + aa, ymax + aa);
 	return 0;
 }
 
@@ -1632,6 +3106,8 @@ _pixels_rect(lua_State *L, int aa)
 	int x2 = luaL_checknumber(L, 4);
 	int y2 = luaL_checknumber(L, 5);
 	checkcolorpat(L, 6, &color, &pat);
+	pixels_mark_draw(src, MIN(x1, x2) - aa, MIN(y1, y2) - aa,
+		MAX(x1, x2) + aa, MAX(y1, y2) + aa);
 	(aa)?lineAA(&src->img, x1, y1, x2, y1, &color):
 		line(&src->img, x1, y1, x2, y1, &color, pat);
 	(aa)?lineAA(&src->img, x2, y1, x2, y2, &color):
@@ -1729,10 +3205,95 @@ pixels_stretch(lua_State *L)
 	w = luaL_optnumber(L, 5, -1);
 	h = luaL_optnumber(L, 6, -1);
 
+	pixels_mark_draw(dst, x, y, x + (w < 0 ? dst->img.w : w) - 1,
+		y + (h < 0 ? dst->img.h : h) - 1);
 	img_pixels_stretch(&src->img, &dst->img, x, y, w, h);
 	return 0;
 }
 
+static int
+pixels_blit_affine(lua_State *L)
+{
+	struct lua_pixels *src, *dst;
+	float m[6];
+	int i, r[4], smooth;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	if (lua_istable(L, 3)) { /* {a, b, c, d, tx, ty} */
+		static const int idx[6] = { 0, 1, 3, 4, 2, 5 };
+		for (i = 0; i < 6; i++) {
+			lua_rawgeti(L, 3, i + 1);
+			m[idx[i]] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		smooth = lua_toboolean(L, 4);
+	} else {
+		float x, y, a, sx, sy, ox, oy, c, s;
+		x = luaL_optnumber(L, 3, 0);
+		y = luaL_optnumber(L, 4, 0);
+		a = luaL_optnumber(L, 5, 0);
+		sx = luaL_optnumber(L, 6, 1);
+		sy = luaL_optnumber(L, 7, sx);
+		ox = luaL_optnumber(L, 8, 0);
+		oy = luaL_optnumber(L, 9, 0);
+		smooth = lua_toboolean(L, 10);
+		c = cosf(a);
+		s = sinf(a);
+		m[0] = c * sx; m[1] = -s * sy;
+		m[3] = s * sx; m[4] = c * sy;
+		m[2] = x - m[0] * ox - m[1] * oy;
+		m[5] = y - m[3] * ox - m[4] * oy;
+	}
+	affine_bbox(src->img.w, src->img.h, m, r);
+	pixels_mark_draw(dst, r[0], r[1], r[2], r[3]);
+	img_blit_affine(&src->img, &dst->img, m, smooth);
+	return 0;
+}
+
+static int
+pixels_mode7(lua_State *L)
+{
+	struct lua_pixels *dst, *tex;
+	double p[4];
+	int y, i, wrap, func, y1 = -1, y2 = -1;
+	img_t *img;
+	dst = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	tex = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	func = lua_isfunction(L, 3);
+	if (!func)
+		luaL_checktype(L, 3, LUA_TTABLE);
+	wrap = !!strcmp(luaL_optstring(L, 4, "wrap"), "clamp");
+	if (tex->img.w > 0x4000 || tex->img.h > 0x4000)
+		return 0;
+	img = &dst->img;
+	/* lines are rows in drawing coordinates */
+	for (y = img->clip_y1 - img->yoff; y < img->clip_y2 - img->yoff; y++) {
+		if (func) { /* f(y) -> u, v, du, dv */
+			lua_pushvalue(L, 3);
+			lua_pushinteger(L, y);
+			lua_call(L, 1, 4);
+		} else { /* {u, v, du, dv, ...} from row 0 */
+			if (y < 0)
+				continue;
+			for (i = 0; i < 4; i++)
+				lua_rawgeti(L, 3, y * 4 + i + 1);
+		}
+		for (i = 0; i < 4; i++)
+			p[i] = lua_tonumber(L, i - 4);
+		i = lua_isnumber(L, -4);
+		lua_pop(L, 4);
+		if (!i) /* no line */
+			continue;
+		mode7_row(img, y, &tex->img, p[0], p[1], p[2], p[3], wrap);
+		if (y1 < 0)
+			y1 = y + img->yoff;
+		y2 = y + img->yoff;
+	}
+	if (y1 >= 0 && img->clip_x1 < img->clip_x2)
+		pixels_mark(dst, img->clip_x1, y1, img->clip_x2 - 1, y2);
+	return 0;
+}
+
 static int
 pixels_clip(lua_State *L)
 {
@@ -1789,15 +3350,154 @@ pixels_nooffset(lua_State *L)
 }
 
 static int
-pixels_free(lua_State *L)
+pixels_scroll_origin(lua_State *L)
 {
 	struct lua_pixels *src;
+	int w, h;
 	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
-	if (!src->img.used)
+	w = src->img.w;
+	h = src->img.h;
+	if (!lua_isnoneornil(L, 2) && !src->parent) {
+		if (direct_pxl == src)
+			pixels_detach();
+		src->direct = 0;
+		src->ring_x = ((src->ring_x + luaL_checkinteger(L, 2) % w) % w + w) % w;
+		src->ring_y = ((src->ring_y + luaL_optinteger(L, 3, 0) % h) % h + h) % h;
+		src->ndirty = -1; /* whole picture moves */
+	}
+	lua_pushinteger(L, src->ring_x);
+	lua_pushinteger(L, src->ring_y);
+	return 2;
+}
+
+/* with scroll origin drawing coordinates wrap around: the method
+   runs once per part of the buffer, offset and clip moved there */
+static int
+pixels_ring_call(lua_State *L)
+{
+	lua_CFunction fn = lua_tocfunction(L, lua_upvalueindex(1));
+	int di = lua_tointeger(L, lua_upvalueindex(2)); /* 0 - copy/blend */
+	struct lua_pixels *dst;
+	img_t *img, save;
+	int i, j, k, n, t, kept = 0, sx[2], sy[2];
+	if (!di)
+		di = lua_isuserdata(L, 2) ? 2 : 6;
+	dst = (struct lua_pixels*)lua_touserdata(L, di);
+	if (!dst || dst->type != PIXELS_MAGIC || (!dst->ring_x && !dst->ring_y))
+		return fn(L);
+	img = &dst->img;
+	save = *img;
+	n = lua_gettop(L);
+	sx[0] = dst->ring_x; sx[1] = dst->ring_x - img->w;
+	sy[0] = dst->ring_y; sy[1] = dst->ring_y - img->h;
+	for (j = 0; j < (dst->ring_y ? 2 : 1); j++) {
+		for (i = 0; i < (dst->ring_x ? 2 : 1); i++) {
+			img->xoff = save.xoff + sx[i];
+			img->yoff = save.yoff + sy[j];
+			img->clip_x1 = MAX(save.clip_x1 + sx[i], 0);
+			img->clip_y1 = MAX(save.clip_y1 + sy[j], 0);
+			img->clip_x2 = MIN(save.clip_x2 + sx[i], img->w);
+			img->clip_y2 = MIN(save.clip_y2 + sy[j], img->h);
+			if (img->clip_x1 >= img->clip_x2 || img->clip_y1 >= img->clip_y2)
+				continue;
+			t = lua_gettop(L);
+			lua_pushvalue(L, lua_upvalueindex(1));
+			for (k = 1; k <= n; k++)
+				lua_pushvalue(L, k);
+			if (lua_pcall(L, n, LUA_MULTRET, 0)) {
+				*img = save;
+				return lua_error(L);
+			}
+			if (lua_gettop(L) == t)
+				continue;
+			for (; kept > 0; kept--) /* results of the last part */
+				lua_remove(L, n + 1);
+			kept = lua_gettop(L) - n;
+		}
+	}
+	*img = save;
+	return kept;
+}
+
+static int
+pixels_view(lua_State *L)
+{
+	int x, y, w, h;
+	struct lua_pixels *src, *owner, *hdr;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	x = luaL_checkinteger(L, 2);
+	y = luaL_checkinteger(L, 3);
+	w = luaL_checkinteger(L, 4);
+	h = luaL_checkinteger(L, 5);
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		x + w > src->img.w || y + h > src->img.h)
+		return 0;
+	owner = src->parent ? src->parent : src;
+	if (owner->direct) /* memory may move to the texture */
+		return 0;
+	hdr = lua_newuserdata(L, sizeof(*hdr));
+	if (!hdr)
+		return 0;
+	hdr->type = PIXELS_MAGIC;
+	hdr->size = w * h * 4;
+	img_init(&hdr->img, w, h);
+	hdr->img.stride = src->img.stride;
+	hdr->img.ptr = src->img.ptr + (y * src->img.stride + x) * 4;
+	hdr->img.used = 0; /* memory belongs to owner */
+	if (owner->img.used) /* not a thread copy */
+		owner->img.used ++;
+	hdr->parent = owner;
+	hdr->direct = 0;
+	hdr->mem = NULL;
+	hdr->dirty = NULL;
+	hdr->ndirty = -1;
+	hdr->shared = 0;
+	hdr->gen = 0;
+	hdr->spans = NULL;
+	hdr->spans_gen = hdr->gen - 1; /* built after a repeat */
+	hdr->spans_ok = 0;
+	hdr->ring_x = 0;
+	hdr->ring_y = 0;
+	if (src->parent)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, src->ref);
+	else
+		lua_pushvalue(L, 1);
+	hdr->ref = luaL_ref(L, LUA_REGISTRYINDEX); /* keep owner alive */
+	luaL_getmetatable(L, "pixels metatable");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+pixels_free(lua_State *L)
+{
+	struct lua_pixels *src, *owner;
+	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	owner = src;
+	if (src->parent) { /* view */
+		owner = src->parent;
+		luaL_unref(L, LUA_REGISTRYINDEX, src->ref);
+	}
+	if (expose_last == src)
+		expose_last = NULL;
+	if (src->dirty) {
+		free(src->dirty);
+		src->dirty = NULL;
+	}
+	if (src->spans) {
+		free(src->spans);
+		src->spans = NULL;
+	}
+	if (!owner->img.used)
 		return 0;
-	src->img.used --;
-	if (src->img.used == 0 && src->img.ptr)
-		free(src->img.ptr);
+	if (direct_pxl == src) {
+		WindowUnlock();
+		src->img.ptr = src->mem;
+		direct_pxl = NULL;
+	}
+	owner->img.used --;
+	if (owner->img.used == 0 && owner->img.ptr)
+		free(owner->img.ptr);
 	return 0;
 }
 
@@ -1809,20 +3509,29 @@ static const luaL_Reg pixels_mt[] = {
 	{ "nooffset", pixels_nooffset },
 	{ "pixel", pixels_pixel },
 	{ "buff", pixels_buff },
+	{ "data", pixels_data },
+	{ "set_data", pixels_set_data },
+	{ "ptr", pixels_ptr },
 	{ "size", pixels_size },
 	{ "fill", pixels_fill },
 	{ "clear", pixels_clear },
 	{ "copy", pixels_copy },
 	{ "blend", pixels_blend },
+	{ "blend_mode", pixels_blend_mode },
 	{ "expose", pixels_expose },
 	{ "line", pixels_line },
 	{ "lineAA", pixels_lineAA },
 	{ "fill_triangle", pixels_triangle },
+	{ "tex_triangle", pixels_tex_triangle },
 	{ "fill_rect", pixels_fill_rect },
 	{ "circle", pixels_circle },
 	{ "circleAA", pixels_circleAA },
 	{ "fill_circle", pixels_fill_circle },
+	{ "ellipse", pixels_ellipse },
+	{ "fill_ellipse", pixels_fill_ellipse },
 	{ "fill_poly", pixels_fill_poly },
+	{ "fill_polyAA", pixels_fill_polyAA },
+	{ "fill_circleAA", pixels_fill_circleAA },
 	{ "poly", pixels_poly },
 	{ "polyAA", pixels_polyAA },
 	{ "rect", pixels_rect },
@@ -1830,37 +3539,1786 @@ static const luaL_Reg pixels_mt[] = {
 	{ "scale", pixels_scale },
 	{ "flip", pixels_flip },
 	{ "stretch", pixels_stretch },
+	{ "blit_affine", pixels_blit_affine },
+	{ "mode7", pixels_mode7 },
+	{ "view", pixels_view },
+	{ "scroll_origin", pixels_scroll_origin },
+	{ "direct", pixels_direct },
+	{ "dirty", pixels_dirty },
 	{ "__gc", pixels_free },
 	{ NULL, NULL }
 };
 
+/* methods which draw into pixels, with argument of destination */
+static const struct {
+	const char *name;
+	int dst; /* 0 - 2nd or 6th like in copy */
+} pixels_ring_mt[] = {
+	{ "pixel", 1 },
+	{ "fill", 1 },
+	{ "clear", 1 },
+	{ "copy", 0 },
+	{ "blend", 0 },
+	{ "line", 1 },
+	{ "lineAA", 1 },
+	{ "fill_triangle", 1 },
+	{ "tex_triangle", 1 },
+	{ "fill_rect", 1 },
+	{ "circle", 1 },
+	{ "circleAA", 1 },
+	{ "fill_circle", 1 },
+	{ "ellipse", 1 },
+	{ "fill_ellipse", 1 },
+	{ "fill_poly", 1 },
+	{ "fill_polyAA", 1 },
+	{ "fill_circleAA", 1 },
+	{ "poly", 1 },
+	{ "polyAA", 1 },
+	{ "rect", 1 },
+	{ "rectAA", 1 },
+	{ "stretch", 2 },
+	{ "blit_affine", 2 },
+	{ "mode7", 1 },
+	{ NULL, 0 }
+};
+
 void
 pixels_create_meta(lua_State *L)
 {
+	int i;
 	luaL_newmetatable (L, "pixels metatable");
 	luaL_setfuncs_int(L, pixels_mt, 0);
+	for (i = 0; pixels_ring_mt[i].name; i++) {
+		lua_getfield(L, -1, pixels_ring_mt[i].name);
+		lua_pushinteger(L, pixels_ring_mt[i].dst);
+		lua_pushcclosure(L, pixels_ring_call, 2);
+		lua_setfield(L, -2, pixels_ring_mt[i].name);
+	}
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 }
 
-static color_t bgcol = {};
+/* recorded drawing commands, replayed in one call */
+#define CMDLIST_MAGIC 0x1984
+
+enum {
+	CMD_CLEAR,
+	CMD_FILL,
+	CMD_PIXEL,
+	CMD_LINE,
+	CMD_LINEAA,
+	CMD_RECT,
+	CMD_RECTAA,
+	CMD_TRIANGLE,
+	CMD_CIRCLE,
+	CMD_CIRCLEAA,
+	CMD_FILL_CIRCLE,
+	CMD_ELLIPSE,
+	CMD_FILL_ELLIPSE,
+	CMD_COPY,
+	CMD_BLEND,
+	CMD_CLIP,
+	CMD_NOCLIP,
+	CMD_OFFSET,
+};
 
-static int
-gfx_background(lua_State *L)
+struct cmd {
+	int op;
+	int v[8];
+	color_t col;
+	struct lua_pixels *pxl; /* source or pattern */
+};
+
+struct lua_cmdlist {
+	int type;
+	struct cmd *cmds;
+	int nr;
+	int size;
+	int refs; /* table with pixels used by commands */
+};
+
+static void
+cmd_init(struct cmd *c, int op)
 {
-	checkcolor(L, 1, &bgcol);
-	return 0;
+	memset(c, 0, sizeof(*c));
+	c->op = op;
 }
 
+/* append command, after all its arguments are checked */
 static int
-gfx_clear(lua_State *L)
+cmdlist_add(lua_State *L, struct cmd *cmd)
 {
-	WindowClear(bgcol.r, bgcol.g, bgcol.b);
+	struct cmd *c;
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	if (cl->nr >= cl->size) {
+		int size = cl->size ? cl->size * 2 : 64;
+		c = realloc(cl->cmds, size * sizeof(*c));
+		if (!c)
+			return 0;
+		cl->cmds = c;
+		cl->size = size;
+	}
+	cl->cmds[cl->nr ++] = *cmd;
 	return 0;
 }
 
-static int
-gfx_flip(lua_State *L)
+/* keep pixels at idx alive while list refers to it */
+static struct lua_pixels *
+cmdlist_hold(lua_State *L, int idx)
+{
+	struct lua_pixels *pxl;
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	pxl = (struct lua_pixels*)luaL_checkudata(L, idx, "pixels metatable");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cl->refs);
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return pxl;
+}
+
+static int
+cmdlist_colorpat(lua_State *L, int idx, struct cmd *c)
+{
+	img_t *pat;
+	checkcolorpat(L, idx, &c->col, &pat);
+	if (pat)
+		c->pxl = cmdlist_hold(L, idx);
+	return 0;
+}
+
+static int
+cmdlist_fill_cmd(lua_State *L, int op)
+{
+	struct cmd cmd, *c = &cmd;
+	int idx = 2;
+	cmd_init(c, op);
+	if (lua_isnumber(L, 3)) {
+		c->v[0] = luaL_optnumber(L, 2, 0);
+		c->v[1] = luaL_optnumber(L, 3, 0);
+		c->v[2] = luaL_optnumber(L, 4, 0);
+		c->v[3] = luaL_optnumber(L, 5, 0);
+		idx = 6;
+	}
+	if (op == CMD_CLEAR)
+		checkcolor(L, idx, &c->col);
+	else
+		cmdlist_colorpat(L, idx, c);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_clear(lua_State *L)
+{
+	return cmdlist_fill_cmd(L, CMD_CLEAR);
+}
+
+static int
+cmdlist_fill(lua_State *L)
+{
+	return cmdlist_fill_cmd(L, CMD_FILL);
+}
+
+static int
+cmdlist_fill_rect(lua_State *L)
+{
+	int x1, y1, x2, y2;
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, CMD_FILL);
+	x1 = luaL_checknumber(L, 2);
+	y1 = luaL_checknumber(L, 3);
+	x2 = luaL_checknumber(L, 4);
+	y2 = luaL_checknumber(L, 5);
+	c->v[0] = MIN(x1, x2);
+	c->v[1] = MIN(y1, y2);
+	c->v[2] = abs(x2 - x1) + 1;
+	c->v[3] = abs(y2 - y1) + 1;
+	cmdlist_colorpat(L, 6, c);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_pixel(lua_State *L)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, CMD_PIXEL);
+	c->v[0] = luaL_optnumber(L, 2, -1);
+	c->v[1] = luaL_optnumber(L, 3, -1);
+	checkcolor(L, 4, &c->col);
+	return cmdlist_add(L, c);
+}
+
+/* x1, y1, x2, y2, color */
+static int
+cmdlist_line_cmd(lua_State *L, int op)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, op);
+	c->v[0] = luaL_checknumber(L, 2);
+	c->v[1] = luaL_checknumber(L, 3);
+	c->v[2] = luaL_checknumber(L, 4);
+	c->v[3] = luaL_checknumber(L, 5);
+	if (op == CMD_LINEAA || op == CMD_RECTAA)
+		checkcolor(L, 6, &c->col);
+	else
+		cmdlist_colorpat(L, 6, c);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_line(lua_State *L)
+{
+	return cmdlist_line_cmd(L, CMD_LINE);
+}
+
+static int
+cmdlist_lineAA(lua_State *L)
+{
+	return cmdlist_line_cmd(L, CMD_LINEAA);
+}
+
+static int
+cmdlist_rect(lua_State *L)
+{
+	return cmdlist_line_cmd(L, CMD_RECT);
+}
+
+static int
+cmdlist_rectAA(lua_State *L)
+{
+	return cmdlist_line_cmd(L, CMD_RECTAA);
+}
+
+static int
+cmdlist_triangle(lua_State *L)
+{
+	int i;
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, CMD_TRIANGLE);
+	for (i = 0; i < 6; i++)
+		c->v[i] = luaL_optnumber(L, i + 2, 0);
+	if (orient2d(c->v[0], c->v[1], c->v[2], c->v[3], c->v[4], c->v[5]) < 0) {
+		i = c->v[2]; c->v[2] = c->v[4]; c->v[4] = i;
+		i = c->v[3]; c->v[3] = c->v[5]; c->v[5] = i;
+	}
+	cmdlist_colorpat(L, 8, c);
+	return cmdlist_add(L, c);
+}
+
+/* xc, yc, r, color */
+static int
+cmdlist_circle_cmd(lua_State *L, int op)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, op);
+	c->v[0] = luaL_optnumber(L, 2, 0);
+	c->v[1] = luaL_optnumber(L, 3, 0);
+	c->v[2] = luaL_optnumber(L, 4, 0);
+	if (op == CMD_CIRCLEAA)
+		checkcolor(L, 5, &c->col);
+	else
+		cmdlist_colorpat(L, 5, c);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_circle(lua_State *L)
+{
+	return cmdlist_circle_cmd(L, CMD_CIRCLE);
+}
+
+static int
+cmdlist_circleAA(lua_State *L)
+{
+	return cmdlist_circle_cmd(L, CMD_CIRCLEAA);
+}
+
+static int
+cmdlist_fill_circle(lua_State *L)
+{
+	return cmdlist_circle_cmd(L, CMD_FILL_CIRCLE);
+}
+
+static int
+cmdlist_ellipse_cmd(lua_State *L, int op)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, op);
+	c->v[0] = luaL_optnumber(L, 2, 0);
+	c->v[1] = luaL_optnumber(L, 3, 0);
+	c->v[2] = luaL_optnumber(L, 4, 0);
+	c->v[3] = luaL_optnumber(L, 5, 0);
+	cmdlist_colorpat(L, 6, c);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_ellipse(lua_State *L)
+{
+	return cmdlist_ellipse_cmd(L, CMD_ELLIPSE);
+}
+
+static int
+cmdlist_fill_ellipse(lua_State *L)
+{
+	return cmdlist_ellipse_cmd(L, CMD_FILL_ELLIPSE);
+}
+
+/* src, [x, y, w, h], xx, yy */
+static int
+cmdlist_blit_cmd(lua_State *L, int op)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, op);
+	c->pxl = cmdlist_hold(L, 2);
+	if (lua_isnumber(L, 6)) {
+		c->v[0] = luaL_optnumber(L, 3, 0);
+		c->v[1] = luaL_optnumber(L, 4, 0);
+		c->v[2] = luaL_optnumber(L, 5, 0);
+		c->v[3] = luaL_optnumber(L, 6, 0);
+		c->v[4] = luaL_optnumber(L, 7, 0);
+		c->v[5] = luaL_optnumber(L, 8, 0);
+	} else {
+		c->v[4] = luaL_optnumber(L, 3, 0);
+		c->v[5] = luaL_optnumber(L, 4, 0);
+	}
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_copy(lua_State *L)
+{
+	return cmdlist_blit_cmd(L, CMD_COPY);
+}
+
+static int
+cmdlist_blend(lua_State *L)
+{
+	return cmdlist_blit_cmd(L, CMD_BLEND);
+}
+
+static int
+cmdlist_clip(lua_State *L)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, CMD_CLIP);
+	c->v[0] = luaL_checkinteger(L, 2);
+	c->v[1] = luaL_checkinteger(L, 3);
+	c->v[2] = luaL_checkinteger(L, 4);
+	c->v[3] = luaL_checkinteger(L, 5);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_noclip(lua_State *L)
+{
+	struct cmd c;
+	cmd_init(&c, CMD_NOCLIP);
+	return cmdlist_add(L, &c);
+}
+
+static int
+cmdlist_offset(lua_State *L)
+{
+	struct cmd cmd, *c = &cmd;
+	cmd_init(c, CMD_OFFSET);
+	c->v[0] = luaL_optinteger(L, 2, 0);
+	c->v[1] = luaL_optinteger(L, 3, 0);
+	return cmdlist_add(L, c);
+}
+
+static int
+cmdlist_nooffset(lua_State *L)
+{
+	struct cmd c;
+	cmd_init(&c, CMD_OFFSET);
+	return cmdlist_add(L, &c);
+}
+
+/* touched area in image coordinates, -1 if nothing is drawn */
+static int
+cmd_bounds(struct cmd *c, img_t *img, int *r)
+{
+	int *v = c->v;
+	int w, h, aa = 0;
+	switch (c->op) {
+	case CMD_CLEAR:
+	case CMD_FILL:
+		return img_fill_bounds(img, v[0], v[1], v[2], v[3], r);
+	case CMD_PIXEL:
+		return img_bounds(img, v[0], v[1], v[0], v[1], r);
+	case CMD_LINEAA:
+	case CMD_RECTAA:
+		aa = 1;
+	case CMD_LINE:
+	case CMD_RECT:
+		return img_bounds(img, MIN(v[0], v[2]) - aa, MIN(v[1], v[3]) - aa,
+			MAX(v[0], v[2]) + aa, MAX(v[1], v[3]) + aa, r);
+	case CMD_TRIANGLE:
+		return img_bounds(img, MIN3(v[0], v[2], v[4]), MIN3(v[1], v[3], v[5]),
+			MAX3(v[0], v[2], v[4]), MAX3(v[1], v[3], v[5]), r);
+	case CMD_CIRCLEAA:
+		aa = 1;
+	case CMD_CIRCLE:
+	case CMD_FILL_CIRCLE:
+		return img_bounds(img, v[0] - v[2] - aa, v[1] - v[2] - aa,
+			v[0] + v[2] + aa, v[1] + v[2] + aa, r);
+	case CMD_ELLIPSE:
+	case CMD_FILL_ELLIPSE:
+		return img_bounds(img, v[0] - v[2], v[1] - v[3],
+			v[0] + v[2], v[1] + v[3], r);
+	case CMD_COPY:
+	case CMD_BLEND:
+		w = v[2] ? v[2] : c->pxl->img.w;
+		h = v[3] ? v[3] : c->pxl->img.h;
+		return img_bounds(img, v[4], v[5], v[4] + w - 1, v[5] + h - 1, r);
+	}
+	return -1;
+}
+
+/* clip and offset commands */
+static void
+cmd_state(struct cmd *c, img_t *img)
+{
+	int *v = c->v;
+	switch (c->op) {
+	case CMD_CLIP:
+		img_clip(img, v[0], v[1], v[0] + v[2], v[1] + v[3]);
+		break;
+	case CMD_NOCLIP:
+		img_noclip(img);
+		break;
+	case CMD_OFFSET:
+		img_offset(img, v[0], v[1]);
+		break;
+	}
+}
+
+static void
+cmd_draw(struct cmd *c, img_t *img)
+{
+	img_t *pat = c->pxl ? &c->pxl->img : NULL;
+	int *v = c->v;
+	int aa = 0, x, y;
+	unsigned char col[4];
+	switch (c->op) {
+	case CMD_CLEAR:
+		_fill(img, v[0], v[1], v[2], v[3], &c->col, PXL_BLEND_COPY, NULL);
+		break;
+	case CMD_FILL:
+		_fill(img, v[0], v[1], v[2], v[3], &c->col, fill_mode(img, &c->col), pat);
+		break;
+	case CMD_PIXEL:
+		x = v[0] + img->xoff;
+		y = v[1] + img->yoff;
+		if (x < img->clip_x1 || y < img->clip_y1 ||
+			x >= img->clip_x2 || y >= img->clip_y2)
+			break;
+		col[0] = c->col.r; col[1] = c->col.g; col[2] = c->col.b; col[3] = c->col.a;
+		pixel(col, img->ptr + (y * img->stride + x) * 4);
+		break;
+	case CMD_LINE:
+		line(img, v[0], v[1], v[2], v[3], &c->col, pat);
+		break;
+	case CMD_LINEAA:
+		lineAA(img, v[0], v[1], v[2], v[3], &c->col);
+		break;
+	case CMD_RECTAA:
+		aa = 1;
+	case CMD_RECT:
+		(aa)?lineAA(img, v[0], v[1], v[2], v[1], &c->col):
+			line(img, v[0], v[1], v[2], v[1], &c->col, pat);
+		(aa)?lineAA(img, v[2], v[1], v[2], v[3], &c->col):
+			line(img, v[2], v[1], v[2], v[3], &c->col, pat);
+		(aa)?lineAA(img, v[0], v[3], v[2], v[3], &c->col):
+			line(img, v[0], v[3], v[2], v[3], &c->col, pat);
+		(aa)?lineAA(img, v[0], v[1], v[0], v[3], &c->col):
+			line(img, v[0], v[1], v[0], v[3], &c->col, pat);
+		break;
+	case CMD_TRIANGLE:
+		triangle(img, v[0], v[1], v[2], v[3], v[4], v[5], &c->col, pat);
+		break;
+	case CMD_CIRCLE:
+		circle(img, v[0], v[1], v[2], &c->col, pat);
+		break;
+	case CMD_CIRCLEAA:
+		circleAA(img, v[0], v[1], v[2], &c->col);
+		break;
+	case CMD_FILL_CIRCLE:
+		fill_circle(img, v[0], v[1], v[2], &c->col, pat);
+		break;
+	case CMD_ELLIPSE:
+	case CMD_FILL_ELLIPSE:
+		ellipse(img, v[0], v[1], v[2], v[3], &c->col, pat,
+			c->op == CMD_FILL_ELLIPSE);
+		break;
+	case CMD_COPY:
+		img_pixels_blend(pat, v[0], v[1], v[2], v[3], img, v[4], v[5],
+			PXL_BLEND_COPY);
+		break;
+	case CMD_BLEND: /* runs are prepared by exec */
+		pixels_blit(c->pxl, v[0], v[1], v[2] ? v[2] : pat->w,
+			v[3] ? v[3] : pat->h, img, v[4], v[5], 0, 0);
+		break;
+	}
+}
+
+/* worker pool, draws command lists tile by tile */
+#define TILE_SIZE 64
+#define WORKERS_MAX 16
+
+struct bin {
+	int *cmds;
+	int nr;
+	int size;
+};
+
+static struct {
+	int nr;
+	int tids[WORKERS_MAX];
+	int start;
+	int done;
+	int lock;
+	int quit;
+	struct cmd *cmds; /* current job */
+	img_t img;
+	int tw;
+	int th;
+	int next;
+	struct bin *bins;
+	int nbins;
+} pool;
+
+static int
+bin_add(struct bin *b, int cmd)
+{
+	int *cmds;
+	if (b->nr >= b->size) {
+		int size = b->size ? b->size * 2 : 64;
+		if (!(cmds = realloc(b->cmds, size * sizeof(int))))
+			return -1;
+		b->cmds = cmds;
+		b->size = size;
+	}
+	b->cmds[b->nr ++] = cmd;
+	return 0;
+}
+
+static void
+img_clip_tile(img_t *img, int tx, int ty)
+{
+	img->clip_x1 = MAX(img->clip_x1, tx * TILE_SIZE);
+	img->clip_y1 = MAX(img->clip_y1, ty * TILE_SIZE);
+	img->clip_x2 = MIN(img->clip_x2, (tx + 1) * TILE_SIZE);
+	img->clip_y2 = MIN(img->clip_y2, (ty + 1) * TILE_SIZE);
+}
+
+static void
+tile_draw(int t)
+{
+	int i, tx = t % pool.tw, ty = t / pool.tw;
+	struct bin *b = &pool.bins[t];
+	struct cmd *c;
+	img_t img = pool.img;
+	img_clip_tile(&img, tx, ty);
+	for (i = 0; i < b->nr; i++) {
+		c = &pool.cmds[b->cmds[i]];
+		if (c->op >= CMD_CLIP) {
+			cmd_state(c, &img);
+			img_clip_tile(&img, tx, ty);
+		} else
+			cmd_draw(c, &img);
+	}
+}
+
+static void
+pool_run(void)
+{
+	int t;
+	while (1) {
+		MutexLock(pool.lock);
+		t = pool.next ++;
+		MutexUnlock(pool.lock);
+		if (t >= pool.tw * pool.th)
+			break;
+		tile_draw(t);
+	}
+}
+
+static int
+pool_worker(void *data)
+{
+	while (1) {
+		SemWait(pool.start, -1);
+		if (pool.quit)
+			break;
+		pool_run();
+		SemPost(pool.done);
+	}
+	return 0;
+}
+
+static void
+pool_free(void)
+{
+	if (pool.start >= 0)
+		SemDestroy(pool.start);
+	if (pool.done >= 0)
+		SemDestroy(pool.done);
+	if (pool.lock >= 0)
+		MutexDestroy(pool.lock);
+}
+
+static void
+pool_stop(void)
+{
+	int i;
+	if (!pool.nr)
+		return;
+	pool.quit = 1;
+	for (i = 0; i < pool.nr; i++)
+		SemPost(pool.start);
+	for (i = 0; i < pool.nr; i++)
+		ThreadWait(pool.tids[i]);
+	pool.nr = 0;
+	pool.quit = 0;
+	pool_free();
+}
+
+static int
+pool_start(int nr)
+{
+	nr = MIN(nr, WORKERS_MAX);
+	if (nr <= 0)
+		return 0;
+	pool.start = Sem(0);
+	pool.done = Sem(0);
+	pool.lock = Mutex();
+	if (pool.start < 0 || pool.done < 0 || pool.lock < 0) {
+		pool_free();
+		return 0;
+	}
+	while (pool.nr < nr) {
+		if ((pool.tids[pool.nr] = Thread(pool_worker, NULL)) < 0)
+			break;
+		pool.nr ++;
+	}
+	if (!pool.nr)
+		pool_free();
+	return pool.nr;
+}
+
+static void
+cmdlist_exec_serial(struct lua_cmdlist *cl, struct lua_pixels *dst)
+{
+	int i, r[4];
+	struct cmd *c;
+	img_t img = dst->img; /* clip and offset of target are not changed */
+	for (i = 0; i < cl->nr; i++) {
+		c = &cl->cmds[i];
+		if (c->op >= CMD_CLIP)
+			cmd_state(c, &img);
+		else if (!cmd_bounds(c, &img, r)) {
+			pixels_mark(dst, r[0], r[1], r[2], r[3]);
+			cmd_draw(c, &img);
+		}
+	}
+}
+
+static void
+cmdlist_exec_tiles(struct lua_cmdlist *cl, struct lua_pixels *dst)
+{
+	int i, x, y, r[4], nbins;
+	struct cmd *c;
+	img_t img = dst->img;
+	pool.tw = (img.w + TILE_SIZE - 1) / TILE_SIZE;
+	pool.th = (img.h + TILE_SIZE - 1) / TILE_SIZE;
+	nbins = pool.tw * pool.th;
+	if (nbins > pool.nbins) {
+		struct bin *bins = realloc(pool.bins, nbins * sizeof(*bins));
+		if (!bins)
+			goto serial;
+		memset(bins + pool.nbins, 0, (nbins - pool.nbins) * sizeof(*bins));
+		pool.bins = bins;
+		pool.nbins = nbins;
+	}
+	for (i = 0; i < nbins; i++)
+		pool.bins[i].nr = 0;
+	/* bin commands by touched tiles, in order */
+	for (i = 0; i < cl->nr; i++) {
+		c = &cl->cmds[i];
+		if (c->op >= CMD_CLIP) {
+			cmd_state(c, &img);
+			for (x = 0; x < nbins; x++)
+				if (bin_add(&pool.bins[x], i))
+					goto serial;
+			continue;
+		}
+		if (cmd_bounds(c, &img, r))
+			continue;
+		pixels_mark(dst, r[0], r[1], r[2], r[3]);
+		for (y = r[1] / TILE_SIZE; y <= r[3] / TILE_SIZE; y++) {
+			for (x = r[0] / TILE_SIZE; x <= r[2] / TILE_SIZE; x++) {
+				if (bin_add(&pool.bins[y * pool.tw + x], i))
+					goto serial;
+			}
+		}
+	}
+	/* marks are done, so tiles only draw */
+	pool.cmds = cl->cmds;
+	pool.img = dst->img;
+	pool.next = 0;
+	for (i = 0; i < pool.nr; i++)
+		SemPost(pool.start);
+	pool_run();
+	for (i = 0; i < pool.nr; i++)
+		SemWait(pool.done, -1);
+	return;
+serial: /* no memory for bins, marks are idempotent */
+	cmdlist_exec_serial(cl, dst);
+}
+
+/* memory of a and b overlaps: same pixels, views or thread copies */
+static int
+pixels_overlap(struct lua_pixels *a, struct lua_pixels *b)
+{
+	unsigned char *a1 = a->img.ptr, *b1 = b->img.ptr;
+	unsigned char *a2 = a1 + ((a->img.h - 1) * a->img.stride + a->img.w) * 4;
+	unsigned char *b2 = b1 + ((b->img.h - 1) * b->img.stride + b->img.w) * 4;
+	return a1 < b2 && b1 < a2;
+}
+
+static int
+cmdlist_exec(lua_State *L)
+{
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	struct lua_pixels *dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	int i, tiles = pool.nr > 0 && (dst->img.w > TILE_SIZE || dst->img.h > TILE_SIZE);
+	for (i = 0; i < cl->nr; i++) {
+		if (cl->cmds[i].op == CMD_BLEND)
+			pixels_spans_prepare(cl->cmds[i].pxl, dst->img.mode);
+		/* tiles would read pixels other tiles have already changed */
+		if (cl->cmds[i].pxl && pixels_overlap(cl->cmds[i].pxl, dst))
+			tiles = 0;
+	}
+	if (tiles)
+		cmdlist_exec_tiles(cl, dst);
+	else
+		cmdlist_exec_serial(cl, dst);
+	return 0;
+}
+
+static int
+cmdlist_reset(lua_State *L)
+{
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	cl->nr = 0;
+	lua_newtable(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, cl->refs);
+	return 0;
+}
+
+static int
+cmdlist_size(lua_State *L)
+{
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	lua_pushinteger(L, cl->nr);
+	return 1;
+}
+
+static int
+cmdlist_gc(lua_State *L)
+{
+	struct lua_cmdlist *cl = (struct lua_cmdlist*)luaL_checkudata(L, 1, "cmdlist metatable");
+	luaL_unref(L, LUA_REGISTRYINDEX, cl->refs);
+	free(cl->cmds);
+	cl->cmds = NULL;
+	return 0;
+}
+
+static const luaL_Reg cmdlist_mt[] = {
+	{ "clear", cmdlist_clear },
+	{ "fill", cmdlist_fill },
+	{ "fill_rect", cmdlist_fill_rect },
+	{ "pixel", cmdlist_pixel },
+	{ "line", cmdlist_line },
+	{ "lineAA", cmdlist_lineAA },
+	{ "rect", cmdlist_rect },
+	{ "rectAA", cmdlist_rectAA },
+	{ "fill_triangle", cmdlist_triangle },
+	{ "circle", cmdlist_circle },
+	{ "circleAA", cmdlist_circleAA },
+	{ "fill_circle", cmdlist_fill_circle },
+	{ "ellipse", cmdlist_ellipse },
+	{ "fill_ellipse", cmdlist_fill_ellipse },
+	{ "copy", cmdlist_copy },
+	{ "blend", cmdlist_blend },
+	{ "clip", cmdlist_clip },
+	{ "noclip", cmdlist_noclip },
+	{ "offset", cmdlist_offset },
+	{ "nooffset", cmdlist_nooffset },
+	{ "exec", cmdlist_exec },
+	{ "reset", cmdlist_reset },
+	{ "size", cmdlist_size },
+	{ "__gc", cmdlist_gc },
+	{ NULL, NULL }
+};
+
+static void
+cmdlist_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, "cmdlist metatable");
+	luaL_setfuncs_int(L, cmdlist_mt, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+}
+
+static int
+gfx_cmdlist(lua_State *L)
+{
+	struct lua_cmdlist *cl;
+	cl = lua_newuserdata(L, sizeof(*cl));
+	if (!cl)
+		return 0;
+	cl->type = CMDLIST_MAGIC;
+	cl->cmds = NULL;
+	cl->nr = cl->size = 0;
+	lua_newtable(L);
+	cl->refs = luaL_ref(L, LUA_REGISTRYINDEX);
+	luaL_getmetatable(L, "cmdlist metatable");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* tile map over sprite sheet */
+#define TILEMAP_MAGIC 0x1986
+
+struct lua_tilemap {
+	int type;
+	int w;
+	int h;
+	int tw; /* tile size */
+	int th;
+	unsigned short *cells;
+	struct lua_pixels *sheet;
+	int ref; /* keeps sheet alive */
+	unsigned char *opaque; /* tiles without transparent pixels */
+	int nopaque;
+	unsigned int gen; /* sheet state for opaque */
+};
+
+static int
+gfx_tilemap(lua_State *L)
+{
+	struct lua_tilemap *map;
+	int w = luaL_checkinteger(L, 1);
+	int h = luaL_checkinteger(L, 2);
+	struct lua_pixels *sheet = (struct lua_pixels*)luaL_checkudata(L, 3, "pixels metatable");
+	int tw = luaL_optinteger(L, 4, 8);
+	int th = luaL_optinteger(L, 5, tw);
+	if (w <= 0 || h <= 0 || tw <= 0 || th <= 0)
+		return 0;
+	map = lua_newuserdata(L, sizeof(*map));
+	if (!map)
+		return 0;
+	map->type = TILEMAP_MAGIC;
+	map->w = w;
+	map->h = h;
+	map->tw = tw;
+	map->th = th;
+	map->opaque = NULL;
+	map->nopaque = 0;
+	map->cells = calloc(w * h, sizeof(unsigned short));
+	if (!map->cells) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	map->sheet = sheet;
+	lua_pushvalue(L, 3);
+	map->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	luaL_getmetatable(L, "tilemap metatable");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+tilemap_size(lua_State *L)
+{
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	lua_pushinteger(L, map->w);
+	lua_pushinteger(L, map->h);
+	return 2;
+}
+
+static int
+tilemap_get(lua_State *L)
+{
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	if (x < 0 || y < 0 || x >= map->w || y >= map->h)
+		return 0;
+	lua_pushinteger(L, map->cells[y * map->w + x]);
+	return 1;
+}
+
+static int
+tilemap_set(lua_State *L)
+{
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	int v = luaL_checkinteger(L, 4);
+	if (x < 0 || y < 0 || x >= map->w || y >= map->h)
+		return 0;
+	map->cells[y * map->w + x] = v;
+	return 0;
+}
+
+static int
+hexdigit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* one line of loadmap format: two hex digits per cell */
+static void
+tilemap_line(struct lua_tilemap *map, int y, const char *l, size_t len)
+{
+	int x, hi, lo;
+	if (y < 0 || y >= map->h)
+		return;
+	for (x = 0; x < map->w && (size_t)x * 2 + 1 < len; x++) {
+		hi = hexdigit(l[x * 2]);
+		lo = hexdigit(l[x * 2 + 1]);
+		map->cells[y * map->w + x] = (hi < 0 || lo < 0) ? 0 : (hi << 4) | lo;
+	}
+}
+
+static int
+tilemap_load(lua_State *L)
+{
+	int x, y = 0;
+	size_t len;
+	const char *text, *e;
+	char buf[4096];
+	FILE *f;
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	if (lua_istable(L, 2)) { /* result of gfx.loadmap */
+		for (y = 0; y < map->h; y++) {
+			lua_rawgeti(L, 2, y + 1);
+			if (!lua_istable(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			for (x = 0; x < map->w; x++) {
+				lua_rawgeti(L, -1, x + 1);
+				map->cells[y * map->w + x] = lua_tointeger(L, -1);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	text = luaL_checklstring(L, 2, &len);
+	while (len > 0 && (unsigned char)*text <= ' ') {
+		text ++;
+		len --;
+	}
+	while (len > 0 && (unsigned char)text[len - 1] <= ' ')
+		len --;
+	if (memchr(text, '\n', len)) {
+		while (len > 0) {
+			e = memchr(text, '\n', len);
+			x = e ? e - text : len;
+			tilemap_line(map, y++, text, (x > 0 && text[x - 1] == '\r') ? x - 1 : x);
+			if (!e)
+				break;
+			len -= x + 1;
+			text = e + 1;
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	f = fopen(text, "rb");
+	if (!f)
+		return 0;
+	while (fgets(buf, sizeof(buf), f)) {
+		len = strcspn(buf, "\r\n");
+		tilemap_line(map, y++, buf, len);
+	}
+	fclose(f);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* find tiles without transparent pixels, once per sheet change */
+static void
+tilemap_opaque(struct lua_tilemap *map)
+{
+	img_t *img = &map->sheet->img;
+	/* changes of a view are counted by its owner */
+	struct lua_pixels *owner = map->sheet->parent ? map->sheet->parent : map->sheet;
+	int nsp = img->w / map->tw;
+	int nr = nsp * (img->h / map->th);
+	int i, x, y;
+	unsigned char *p;
+	if (map->opaque && map->gen == owner->gen && map->nopaque == nr)
+		return;
+	free(map->opaque);
+	map->opaque = calloc(nr ? nr : 1, 1);
+	map->nopaque = nr;
+	map->gen = owner->gen;
+	if (!map->opaque)
+		return;
+	for (i = 0; i < nr; i++) {
+		map->opaque[i] = 1;
+		for (y = 0; y < map->th && map->opaque[i]; y++) {
+			p = img->ptr + (((i / nsp) * map->th + y) * img->stride +
+				(i % nsp) * map->tw) * 4 + 3;
+			for (x = 0; x < map->tw; x++, p += 4) {
+				if (*p != 255) {
+					map->opaque[i] = 0;
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void
+tilemap_render(struct lua_tilemap *map, struct lua_pixels *dst, int sx, int sy)
+{
+	int x1, y1, x2, y2, tx, ty, v, nsp, opaque, xx, yy;
+	img_t *img = &dst->img;
+	img_t *sheet = &map->sheet->img;
+
+	nsp = sheet->w / map->tw;
+	if (nsp <= 0)
+		return;
+	/* opaque tiles are copied, only if that is what blending gives */
+	opaque = !(map->sheet->parent ? map->sheet->parent : map->sheet)->shared &&
+		img->mode == PXL_BLEND_BLEND;
+	if (opaque)
+		tilemap_opaque(map);
+	pixels_spans_prepare(map->sheet, img->mode);
+	/* map pixels under clip rect */
+	x1 = MAX(img->clip_x1 - img->xoff + sx, 0);
+	y1 = MAX(img->clip_y1 - img->yoff + sy, 0);
+	x2 = MIN(img->clip_x2 - img->xoff + sx, map->w * map->tw) - 1;
+	y2 = MIN(img->clip_y2 - img->yoff + sy, map->h * map->th) - 1;
+	if (x1 > x2 || y1 > y2)
+		return;
+	pixels_mark_draw(dst, x1 - sx, y1 - sy, x2 - sx, y2 - sy);
+	for (ty = y1 / map->th; ty <= y2 / map->th; ty++) {
+		yy = ty * map->th - sy;
+		for (tx = x1 / map->tw; tx <= x2 / map->tw; tx++) {
+			v = map->cells[ty * map->w + tx];
+			if (!v) /* empty */
+				continue;
+			xx = tx * map->tw - sx;
+			if (opaque && map->opaque && v < map->nopaque && map->opaque[v])
+				img_pixels_blend(sheet, (v % nsp) * map->tw, (v / nsp) * map->th,
+					map->tw, map->th, img, xx, yy, PXL_BLEND_COPY);
+			else
+				pixels_blit(map->sheet, (v % nsp) * map->tw, (v / nsp) * map->th,
+					map->tw, map->th, img, xx, yy, 0, 0);
+		}
+	}
+}
+
+static int
+tilemap_draw(lua_State *L)
+{
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	struct lua_pixels *dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	int sx = luaL_optnumber(L, 3, 0);
+	int sy = luaL_optnumber(L, 4, 0);
+	tilemap_render(map, dst, sx, sy);
+	return 0;
+}
+
+static int
+tilemap_gc(lua_State *L)
+{
+	struct lua_tilemap *map = (struct lua_tilemap*)luaL_checkudata(L, 1, "tilemap metatable");
+	luaL_unref(L, LUA_REGISTRYINDEX, map->ref);
+	free(map->cells);
+	free(map->opaque);
+	map->cells = NULL;
+	map->opaque = NULL;
+	return 0;
+}
+
+static const luaL_Reg tilemap_mt[] = {
+	{ "size", tilemap_size },
+	{ "get", tilemap_get },
+	{ "set", tilemap_set },
+	{ "load", tilemap_load },
+	{ "draw", tilemap_draw },
+	{ "__gc", tilemap_gc },
+	{ NULL, NULL }
+};
+
+static void
+tilemap_create_meta(lua_State *L)
+{
+	luaL_newmetatable(L, "tilemap metatable");
+	luaL_setfuncs_int(L, tilemap_mt, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+}
+
+/* indexed surface: one byte per pixel, palette is applied on expose */
+#define INDEXED_MAGIC 0x1988
+
+struct lua_indexed {
+	int type;
+	img_t img;
+	unsigned char *rgba; /* palette applied, for expose */
+};
+
+static struct lua_indexed *
+indexed_new(lua_State *L, int w, int h)
+{
+	struct lua_indexed *ind;
+	if (w <= 0 || h <= 0)
+		return NULL;
+	ind = lua_newuserdata(L, sizeof(*ind));
+	if (!ind)
+		return NULL;
+	ind->type = INDEXED_MAGIC;
+	ind->rgba = NULL;
+	ind->img.ptr = calloc(w, h);
+	if (!ind->img.ptr) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	img_init(&ind->img, w, h);
+	ind->img.bpp = 1;
+	luaL_getmetatable(L, "indexed metatable");
+	lua_setmetatable(L, -2);
+	return ind;
+}
+
+/* row of indices to colors, key index becomes transparent */
+static void
+pal_row(const unsigned char *s, unsigned char *d, int w, int key)
+{
+	for (; w > 0; w--, s++, d += 4) {
+		if (*s == key)
+			memset(d, 0, 4);
+		else
+			memcpy(d, &pal[*s], 4);
+	}
+}
+
+/* indexed src to indexed or rgba dst, pixels of key index are skipped */
+static void
+indexed_blit(img_t *src, int x, int y, int w, int h,
+	img_t *dst, int xx, int yy, int key, int copy)
+{
+	unsigned char row[64 * 4], *s, *d;
+	int cy, cx, n;
+	if (!w)
+		w = src->w;
+	if (!h)
+		h = src->h;
+	if (x < 0 || y < 0 || x + w > src->w || y + h > src->h)
+		return;
+	xx += dst->xoff;
+	yy += dst->yoff;
+	if (xx < dst->clip_x1) {
+		x += dst->clip_x1 - xx;
+		w -= dst->clip_x1 - xx;
+		xx = dst->clip_x1;
+	}
+	if (yy < dst->clip_y1) {
+		y += dst->clip_y1 - yy;
+		h -= dst->clip_y1 - yy;
+		yy = dst->clip_y1;
+	}
+	w = MIN(w, dst->clip_x2 - xx);
+	h = MIN(h, dst->clip_y2 - yy);
+	if (w <= 0 || h <= 0)
+		return;
+	for (cy = 0; cy < h; cy++) {
+		s = src->ptr + (y + cy) * src->stride + x;
+		if (dst->bpp == 1) {
+			d = dst->ptr + (yy + cy) * dst->stride + xx;
+			if (copy)
+				memmove(d, s, w);
+			else {
+				for (cx = 0; cx < w; cx++)
+					if (s[cx] != key)
+						d[cx] = s[cx];
+			}
+			continue;
+		}
+		d = dst->ptr + ((yy + cy) * dst->stride + xx) * 4;
+		for (cx = 0; cx < w; cx += n) { /* through the palette */
+			n = MIN(w - cx, 64);
+			pal_row(s + cx, row, n, copy ? -1 : key);
+			if (copy)
+				memcpy(d, row, n * 4);
+			else
+				blend_mode_row(row, d, n, dst->mode);
+			d += n * 4;
+		}
+	}
+}
+
+static void
+indexed_line(img_t *img, int x1, int y1, int x2, int y2, int c)
+{
+	int dx, dy, sx, sy, err, e2;
+	x1 += img->xoff; x2 += img->xoff;
+	y1 += img->yoff; y2 += img->yoff;
+	if (MAX(x1, x2) < img->clip_x1 || MIN(x1, x2) >= img->clip_x2 ||
+		MAX(y1, y2) < img->clip_y1 || MIN(y1, y2) >= img->clip_y2)
+		return;
+	dx = abs(x2 - x1);
+	dy = -abs(y2 - y1);
+	sx = (x1 < x2) ? 1 : -1;
+	sy = (y1 < y2) ? 1 : -1;
+	err = dx + dy;
+	for (;;) {
+		if (x1 >= img->clip_x1 && x1 < img->clip_x2 &&
+			y1 >= img->clip_y1 && y1 < img->clip_y2)
+			img->ptr[y1 * img->stride + x1] = c;
+		if (x1 == x2 && y1 == y2)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x1 += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y1 += sy;
+		}
+	}
+}
+
+/* same stepping as circle(), so outlines match pixels */
+static void
+indexed_ring(img_t *img, int xc, int yc, int rr, int c)
+{
+	int x = -rr, y = 0, err = 2 - 2 * rr, i;
+	int px[4], py[4];
+
+	if (rr <= 0)
+		return;
+	xc += img->xoff;
+	yc += img->yoff;
+	if (xc + rr < img->clip_x1 || yc + rr < img->clip_y1 ||
+	    xc - rr >= img->clip_x2 || yc - rr >= img->clip_y2)
+		return;
+	do {
+		px[0] = xc - x; py[0] = yc + y;
+		px[1] = xc - y; py[1] = yc - x;
+		px[2] = xc + x; py[2] = yc - y;
+		px[3] = xc + y; py[3] = yc + x;
+		for (i = 0; i < 4; i++) {
+			if (px[i] >= img->clip_x1 && px[i] < img->clip_x2 &&
+			    py[i] >= img->clip_y1 && py[i] < img->clip_y2)
+				img->ptr[py[i] * img->stride + px[i]] = c;
+		}
+		rr = err;
+		if (rr <= y)
+			err += ++y * 2 + 1;
+		if (rr > x || err > y)
+			err += ++x * 2 + 1;
+	} while (x < 0);
+}
+
+static void
+indexed_fill(img_t *img, int *r, int c)
+{
+	int y;
+	for (y = r[1]; y <= r[3]; y++)
+		memset(img->ptr + y * img->stride + r[0], c, r[2] - r[0] + 1);
+}
+
+static int
+indexed_size(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	lua_pushinteger(L, ind->img.w);
+	lua_pushinteger(L, ind->img.h);
+	return 2;
+}
+
+static int
+indexed_clip(lua_State *L)
+{
+	int x, y, w, h;
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	lua_pushinteger(L, ind->img.clip_x1);
+	lua_pushinteger(L, ind->img.clip_y1);
+	lua_pushinteger(L, ind->img.clip_x2 - ind->img.clip_x1);
+	lua_pushinteger(L, ind->img.clip_y2 - ind->img.clip_y1);
+	if (lua_isnil(L, 2))
+		return 4;
+	x = luaL_checkinteger(L, 2);
+	y = luaL_checkinteger(L, 3);
+	w = luaL_checkinteger(L, 4);
+	h = luaL_checkinteger(L, 5);
+	img_clip(&ind->img, x, y, x + w, y + h);
+	return 4;
+}
+
+static int
+indexed_noclip(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	img_noclip(&ind->img);
+	return 0;
+}
+
+static int
+indexed_offset(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	lua_pushinteger(L, ind->img.xoff);
+	lua_pushinteger(L, ind->img.yoff);
+	if (lua_isnil(L, 2))
+		return 2;
+	img_offset(&ind->img, luaL_checkinteger(L, 2), luaL_checkinteger(L, 3));
+	return 2;
+}
+
+static int
+indexed_nooffset(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	img_offset(&ind->img, 0, 0);
+	return 0;
+}
+
+static int
+indexed_val(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	int x = luaL_optnumber(L, 2, -1);
+	int y = luaL_optnumber(L, 3, -1);
+	unsigned char *p;
+	if (x < 0 || y < 0 || x >= ind->img.w || y >= ind->img.h)
+		return 0;
+	p = ind->img.ptr + y * ind->img.stride + x;
+	if (lua_isnoneornil(L, 4)) {
+		lua_pushinteger(L, *p);
+		return 1;
+	}
+	*p = luaL_checkinteger(L, 4);
+	return 0;
+}
+
+static int
+indexed_pixel(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	img_t *img = &ind->img;
+	int x = luaL_optnumber(L, 2, -1) + img->xoff;
+	int y = luaL_optnumber(L, 3, -1) + img->yoff;
+	unsigned char *p;
+	if (x < img->clip_x1 || y < img->clip_y1 ||
+		x >= img->clip_x2 || y >= img->clip_y2)
+		return 0;
+	p = img->ptr + y * img->stride + x;
+	if (lua_isnoneornil(L, 4)) {
+		lua_pushinteger(L, *p);
+		return 1;
+	}
+	*p = luaL_checkinteger(L, 4);
+	return 0;
+}
+
+static int
+indexed_clear(lua_State *L)
+{
+	int x = 0, y = 0, w = 0, h = 0, c, r[4];
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	if (!lua_isnumber(L, 3)) {
+		c = luaL_optinteger(L, 2, 0);
+	} else {
+		x = luaL_optnumber(L, 2, 0);
+		y = luaL_optnumber(L, 3, 0);
+		w = luaL_optnumber(L, 4, 0);
+		h = luaL_optnumber(L, 5, 0);
+		c = luaL_optinteger(L, 6, 0);
+	}
+	if (!img_fill_bounds(&ind->img, x, y, w, h, r))
+		indexed_fill(&ind->img, r, c);
+	return 0;
+}
+
+static int
+indexed_fill_rect(lua_State *L)
+{
+	int r[4];
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	int x1 = luaL_checknumber(L, 2);
+	int y1 = luaL_checknumber(L, 3);
+	int x2 = luaL_checknumber(L, 4);
+	int y2 = luaL_checknumber(L, 5);
+	int c = luaL_checkinteger(L, 6);
+	if (!img_bounds(&ind->img, x1, y1, x2, y2, r))
+		indexed_fill(&ind->img, r, c);
+	return 0;
+}
+
+static int
+indexed_line_op(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	int x1 = luaL_optnumber(L, 2, 0);
+	int y1 = luaL_optnumber(L, 3, 0);
+	int x2 = luaL_optnumber(L, 4, 0);
+	int y2 = luaL_optnumber(L, 5, 0);
+	indexed_line(&ind->img, x1, y1, x2, y2, luaL_checkinteger(L, 6));
+	return 0;
+}
+
+static int
+indexed_rect(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	int x1 = luaL_checknumber(L, 2);
+	int y1 = luaL_checknumber(L, 3);
+	int x2 = luaL_checknumber(L, 4);
+	int y2 = luaL_checknumber(L, 5);
+	int c = luaL_checkinteger(L, 6);
+	indexed_line(&ind->img, x1, y1, x2, y1, c);
+	indexed_line(&ind->img, x2, y1, x2, y2, c);
+	indexed_line(&ind->img, x1, y2, x2, y2, c);
+	indexed_line(&ind->img, x1, y1, x1, y2, c);
+	return 0;
+}
+
+static int
+indexed_ellipse_op(lua_State *L, int circle, int filled)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	color_t col = { 0, 0, 0, 255 };
+	int xc = luaL_optnumber(L, 2, 0);
+	int yc = luaL_optnumber(L, 3, 0);
+	int rx = luaL_optnumber(L, 4, 0);
+	int ry = circle ? rx : luaL_optnumber(L, 5, 0);
+	col.r = luaL_checkinteger(L, circle ? 5 : 6); /* spans take col[0] */
+	if (circle && !filled)
+		indexed_ring(&ind->img, xc, yc, rx, col.r);
+	else
+		ellipse(&ind->img, xc, yc, rx, ry, &col, NULL, filled);
+	return 0;
+}
+
+static int
+indexed_circle(lua_State *L)
+{
+	return indexed_ellipse_op(L, 1, 0);
+}
+
+static int
+indexed_fill_circle(lua_State *L)
+{
+	return indexed_ellipse_op(L, 1, 1);
+}
+
+static int
+indexed_ellipse(lua_State *L)
+{
+	return indexed_ellipse_op(L, 0, 0);
+}
+
+static int
+indexed_fill_ellipse(lua_State *L)
+{
+	return indexed_ellipse_op(L, 0, 1);
+}
+
+static int
+indexed_triangle(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	color_t col = { 0, 0, 0, 255 };
+	int x0 = luaL_optnumber(L, 2, 0);
+	int y0 = luaL_optnumber(L, 3, 0);
+	int x1 = luaL_optnumber(L, 4, 0);
+	int y1 = luaL_optnumber(L, 5, 0);
+	int x2 = luaL_optnumber(L, 6, 0);
+	int y2 = luaL_optnumber(L, 7, 0);
+	col.r = luaL_checkinteger(L, 8);
+	if (orient2d(x0, y0, x1, y1, x2, y2) < 0)
+		triangle(&ind->img, x0, y0, x2, y2, x1, y1, &col, NULL);
+	else
+		triangle(&ind->img, x0, y0, x1, y1, x2, y2, &col, NULL);
+	return 0;
+}
+
+static int
+indexed_fill_poly(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	unsigned char col[4] = { 0, 0, 0, 255 };
+	int nr, *v, r[4], nonzero;
+	void *mem;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	col[0] = luaL_checkinteger(L, 3);
+	nonzero = luaL_checkoption(L, 4, "evenodd", fill_rules);
+	nr = poly_vertices(L, 2, &ind->img, &v, &mem, r);
+	if (nr)
+		fill_poly(&ind->img, v, nr, col, NULL, nonzero, mem);
+	return 0;
+}
+
+static int
+indexed_blit_op(lua_State *L, int copy)
+{
+	int x = 0, y = 0, w = 0, h = 0, xx, yy, key, di = 2;
+	struct lua_indexed *src = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	int *type;
+	img_t *dst;
+	if (!lua_isuserdata(L, 2)) {
+		x = luaL_optnumber(L, 2, 0);
+		y = luaL_optnumber(L, 3, 0);
+		w = luaL_optnumber(L, 4, 0);
+		h = luaL_optnumber(L, 5, 0);
+		di = 6;
+	}
+	type = (int *)lua_touserdata(L, di);
+	xx = luaL_optnumber(L, di + 1, 0);
+	yy = luaL_optnumber(L, di + 2, 0);
+	key = luaL_optinteger(L, di + 3, 0);
+	if (!type)
+		return 0;
+	if (*type == INDEXED_MAGIC)
+		dst = &((struct lua_indexed *)type)->img;
+	else if (*type == PIXELS_MAGIC) {
+		struct lua_pixels *pxl = (struct lua_pixels *)type;
+		pixels_mark_draw(pxl, xx, yy, xx + (w ? w : src->img.w) - 1,
+			yy + (h ? h : src->img.h) - 1);
+		dst = &pxl->img;
+	} else
+		return 0;
+	indexed_blit(&src->img, x, y, w, h, dst, xx, yy, key, copy);
+	return 0;
+}
+
+static int
+indexed_copy(lua_State *L)
+{
+	return indexed_blit_op(L, 1);
+}
+
+static int
+indexed_blend(lua_State *L)
+{
+	return indexed_blit_op(L, 0);
+}
+
+/* rgba pixels through the current palette */
+static int
+indexed_pixels(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	struct lua_pixels *hdr;
+	if (!(hdr = pixels_new(L, ind->img.w, ind->img.h)))
+		return 0;
+	indexed_blit(&ind->img, 0, 0, 0, 0, &hdr->img, 0, 0, -1, 1);
+	return 1;
+}
+
+static int
+indexed_expose(lua_State *L)
+{
+	int dx, dy, dw, dh, y;
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	img_t *img = &ind->img;
+	dx = luaL_optnumber(L, 2, 0);
+	dy = luaL_optnumber(L, 3, 0);
+	dw = luaL_optnumber(L, 4, img->w);
+	dh = luaL_optnumber(L, 5, img->h);
+	if (!ind->rgba && !(ind->rgba = malloc(img->w * img->h * 4)))
+		return 0;
+	/* palette is applied here only, so cycling it needs no redraw */
+	for (y = 0; y < img->h; y++)
+		pal_row(img->ptr + y * img->stride, ind->rgba + y * img->w * 4,
+			img->w, -1);
+	pixels_detach();
+	WindowExpose(ind->rgba, img->w, img->h, img->w * 4, dx, dy, dw, dh);
+	expose_last = NULL; /* texture holds no pixels */
+	return 0;
+}
+
+static int
+indexed_gc(lua_State *L)
+{
+	struct lua_indexed *ind = (struct lua_indexed*)luaL_checkudata(L, 1, "indexed metatable");
+	free(ind->img.ptr);
+	free(ind->rgba);
+	ind->img.ptr = NULL;
+	ind->rgba = NULL;
+	return 0;
+}
+
+static const luaL_Reg indexed_mt[] = {
+	{ "size", indexed_size },
+	{ "clip", indexed_clip },
+	{ "noclip", indexed_noclip },
+	{ "offset", indexed_offset },
+	{ "nooffset", indexed_nooffset },
+	{ "val", indexed_val },
+	{ "pixel", indexed_pixel },
+	{ "clear", indexed_clear },
+	{ "fill", indexed_clear },
+	{ "fill_rect", indexed_fill_rect },
+	{ "line", indexed_line_op },
+	{ "rect", indexed_rect },
+	{ "circle", indexed_circle },
+	{ "fill_circle", indexed_fill_circle },
+	{ "ellipse", indexed_ellipse },
+	{ "fill_ellipse", indexed_fill_ellipse },
+	{ "fill_triangle", indexed_triangle },
+	{ "fill_poly", indexed_fill_poly },
+	{ "copy", indexed_copy },
+	{ "blend", indexed_blend },
+	{ "pixels", indexed_pixels },
+	{ "expose", indexed_expose },
+	{ "__gc", indexed_gc },
+	{ NULL, NULL }
+};
+
+static void
+indexed_create_meta(lua_State *L)
+{
+	int i;
+	static const char *ring[] = { "copy", "blend", NULL };
+	luaL_newmetatable(L, "indexed metatable");
+	luaL_setfuncs_int(L, indexed_mt, 0);
+	for (i = 0; ring[i]; i++) { /* scroll origin of target pixels */
+		lua_getfield(L, -1, ring[i]);
+		lua_pushinteger(L, 0);
+		lua_pushcclosure(L, pixels_ring_call, 2);
+		lua_setfield(L, -2, ring[i]);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+}
+
+/* gfx.new(w, h, "indexed") or pixels */
+static int
+gfx_new(lua_State *L)
+{
+	if (lua_isnumber(L, 1) && lua_isstring(L, 3) &&
+		!strcmp(lua_tostring(L, 3), "indexed"))
+		return indexed_new(L, luaL_checkinteger(L, 1),
+			luaL_checkinteger(L, 2)) ? 1 : 0;
+	return gfx_pixels_new(L);
+}
+
+/* sprite nr of 8x8 cells sheet */
+static void
+pixels_spr(struct lua_pixels *sheet, struct lua_pixels *dst, int nr,
+	int x, int y, int w, int h, int flipx, int flipy)
+{
+	int nsp = sheet->img.w / 8;
+	if (nr < 0 || nsp <= 0)
+		return;
+	w *= 8;
+	h *= 8;
+	pixels_mark_draw(dst, x, y, x + w - 1, y + h - 1);
+	pixels_spans_prepare(sheet, dst->img.mode);
+	pixels_blit(sheet, (nr % nsp) * 8, (nr / nsp) * 8, w, h,
+		&dst->img, x, y, flipx, flipy);
+}
+
+static int
+gfx_spr(lua_State *L)
+{
+	struct lua_pixels *sheet, *dst;
+	sheet = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	pixels_spr(sheet, dst, luaL_checknumber(L, 3),
+		luaL_optnumber(L, 4, 0), luaL_optnumber(L, 5, 0),
+		luaL_optnumber(L, 6, 1), luaL_optnumber(L, 7, 1),
+		lua_toboolean(L, 8), lua_toboolean(L, 9));
+	return 0;
+}
+
+static __inline int
+spr_field(lua_State *L, int idx, int def)
+{
+	int v = def;
+	lua_rawgeti(L, 3, idx);
+	if (lua_isboolean(L, -1))
+		v = lua_toboolean(L, -1);
+	else if (!lua_isnil(L, -1))
+		v = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+/* records: nr, x, y, w, h, flipx, flipy */
+static int
+gfx_spr_batch(lua_State *L)
+{
+	int i, nr;
+	struct lua_pixels *sheet, *dst;
+	sheet = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
+	dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	luaL_checktype(L, 3, LUA_TTABLE);
+	nr = lua_rawlen(L, 3) / 7;
+	for (i = 0; i < nr * 7; i += 7) {
+		pixels_spr(sheet, dst, spr_field(L, i + 1, -1),
+			spr_field(L, i + 2, 0), spr_field(L, i + 3, 0),
+			spr_field(L, i + 4, 1), spr_field(L, i + 5, 1),
+			spr_field(L, i + 6, 0), spr_field(L, i + 7, 0));
+	}
+	return 0;
+}
+
+static int
+gfx_workers(lua_State *L)
+{
+	int nr;
+	if (!lua_isnoneornil(L, 1)) {
+		if (lua_isboolean(L, 1)) /* all cores, with main thread */
+			nr = lua_toboolean(L, 1) ? CPUCount() - 1 : 0;
+		else
+			nr = luaL_checkinteger(L, 1);
+		pool_stop();
+		pool_start(nr);
+	}
+	lua_pushinteger(L, pool.nr);
+	return 1;
+}
+
+static color_t bgcol = {};
+
+static int
+gfx_background(lua_State *L)
+{
+	checkcolor(L, 1, &bgcol);
+	return 0;
+}
+
+static int
+gfx_clear(lua_State *L)
+{
+	WindowClear(bgcol.r, bgcol.g, bgcol.b);
+	return 0;
+}
+
+static int
+gfx_flip(lua_State *L)
 {
 	Flip();
 	return 0;
@@ -1871,7 +5329,7 @@ gfx_icon(lua_State *L)
 {
 	struct lua_pixels *src;
 	src = (struct lua_pixels*)luaL_checkudata(L, 1, "pixels metatable");
-	Icon(src->img.ptr, src->img.w, src->img.h);
+	Icon(src->img.ptr, src->img.w, src->img.h, src->img.stride * 4);
 	return 0;
 }
 
@@ -1900,42 +5358,61 @@ font_size(lua_State *L)
 	return 2;
 }
 
-static void
-img_colorize(img_t *img, color_t *col)
-{
-	unsigned char *ptr = img->ptr;
-	size_t size = img->w * img->h * 4;
-	while (size -= 4) { /* colorize! */
-		memcpy(ptr, col, 3);
-		ptr[3] = ptr[3] * col->a / 255;
-		ptr += 4;
-	}
-}
-
 static int
 font_text(lua_State *L)
 {
-	int w, h;
 	color_t col;
+	unsigned char c[4];
+	img_t *img;
 	struct lua_pixels *pxl;
 	struct lua_font *fn = (struct lua_font*)luaL_checkudata(L, 1, "font metatable");
 	const char *text = luaL_checkstring(L, 2);
 	checkcolor(L, 3, &col);
-	w = font_width(fn->font, text);
-	h = font_height(fn->font);
-	pxl = pixels_new(L, w, h);
+	c[0] = col.r; c[1] = col.g; c[2] = col.b; c[3] = col.a;
+	img = font_run(fn->font, text, c);
+	if (!img)
+		return 0;
+	pxl = pixels_new(L, img->w, img->h); /* only other fonts can be collected */
 	if (!pxl)
 		return 0;
-	memset(pxl->img.ptr, 0, pxl->img.w * pxl->img.h * 4);
-	font_render(fn->font, text, &pxl->img);
-	img_colorize(&pxl->img, &col);
+	memcpy(pxl->img.ptr, img->ptr, img->w * img->h * 4);
 	return 1;
 }
 
+/* text right into pixels, the same as text() and blend() */
+static int
+font_draw(lua_State *L)
+{
+	int x, y, w, h;
+	color_t col;
+	unsigned char c[4];
+	img_t *img;
+	struct lua_font *fn = (struct lua_font*)luaL_checkudata(L, 1, "font metatable");
+	struct lua_pixels *dst = (struct lua_pixels*)luaL_checkudata(L, 2, "pixels metatable");
+	const char *text = luaL_checkstring(L, 3);
+	x = luaL_optnumber(L, 4, 0);
+	y = luaL_optnumber(L, 5, 0);
+	checkcolor(L, 6, &col);
+	c[0] = col.r; c[1] = col.g; c[2] = col.b; c[3] = col.a;
+	img = font_run(fn->font, text, c); /* cached bitmap */
+	w = img ? img->w : 0;
+	h = font_height(fn->font);
+	if (!lua_isnoneornil(L, 7))
+		w = MAX(MIN(w, luaL_checknumber(L, 7)), 0);
+	if (w > 0) {
+		pixels_mark_draw(dst, x, y, x + w - 1, y + h - 1);
+		img_pixels_blend(img, 0, 0, w, h, &dst->img, x, y, PXL_BLEND_BLEND);
+	}
+	lua_pushinteger(L, w);
+	lua_pushinteger(L, h);
+	return 2;
+}
+
 static const luaL_Reg font_mt[] = {
 	{ "__gc", font_gc },
 	{ "size", font_size },
 	{ "text", font_text },
+	{ "draw", font_draw },
 	{ NULL, NULL }
 };
 
@@ -1944,15 +5421,42 @@ font_create_meta(lua_State *L)
 {
 	luaL_newmetatable(L, "font metatable");
 	luaL_setfuncs_int(L, font_mt, 0);
+	lua_getfield(L, -1, "draw"); /* scroll origin of target */
+	lua_pushinteger(L, 2);
+	lua_pushcclosure(L, pixels_ring_call, 2);
+	lua_setfield(L, -2, "draw");
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 }
 
+/* gfx.text_cache([budget]) - hits, misses, used bytes, budget */
+static int
+gfx_text_cache(lua_State *L)
+{
+	unsigned long hits, misses;
+	size_t used, max;
+	font_cache(MAX(luaL_optnumber(L, 1, 0), 0), &hits, &misses, &used, &max);
+	lua_pushnumber(L, hits);
+	lua_pushnumber(L, misses);
+	lua_pushnumber(L, used);
+	lua_pushnumber(L, max);
+	return 4;
+}
+
+/* gfx.renderer() - blend kernels and font renderer in use */
+static int
+gfx_renderer(lua_State *L)
+{
+	lua_pushstring(L, blend_renderer());
+	lua_pushstring(L, font_renderer());
+	return 2;
+}
+
 int
 gfx_font(lua_State *L)
 {
 	const char *filename  = luaL_checkstring(L, 1);
-	float size = luaL_checknumber(L, 2);
+	float size = luaL_optnumber(L, 2, 0); /* not used by .fnt */
 	font_t *font;
 	struct lua_font *fn;
 
@@ -1961,7 +5465,7 @@ gfx_font(lua_State *L)
 		return 0;
 	fn = lua_newuserdata(L, sizeof(*fn));
 	if (!fn) {
-		free(font);
+		font_free(font);
 		return 0;
 	}
 	luaL_getmetatable(L, "font metatable");
@@ -2003,13 +5507,20 @@ gfx_pal(lua_State *L)
 
 static const luaL_Reg
 gfx_lib[] = {
-	{ "new", gfx_pixels_new },
+	{ "new", gfx_new },
+	{ "cmdlist", gfx_cmdlist },
+	{ "workers", gfx_workers },
+	{ "spr", gfx_spr },
+	{ "spr_batch", gfx_spr_batch },
+	{ "tilemap", gfx_tilemap },
 	{ "icon", gfx_icon },
 	{ "flip", gfx_flip },
 	{ "background", gfx_background },
 	{ "clear", gfx_clear },
 	{ "pal", gfx_pal },
 	{ "font", gfx_font },
+	{ "text_cache", gfx_text_cache },
+	{ "renderer", gfx_renderer },
 	{ NULL, NULL }
 };
 
@@ -2020,6 +5531,8 @@ gfx_udata_move(lua_State *from, int idx, lua_State *to)
 	struct lua_pixels *src = (struct lua_pixels*)lua_touserdata(from, idx);
 	if (!src || src->type != PIXELS_MAGIC)
 		return 0;
+	if (src->direct || (src->parent && src->parent->direct))
+		return 0;
 	dst = lua_newuserdata(to, sizeof(*dst));
 	if (!dst)
 		return 0;
@@ -2027,7 +5540,25 @@ gfx_udata_move(lua_State *from, int idx, lua_State *to)
 	dst->size = src->size;
 	dst->img.ptr = src->img.ptr;
 	img_init(&dst->img, src->img.w, src->img.h);
+	dst->img.stride = src->img.stride;
+	dst->parent = NULL;
+	dst->ref = LUA_NOREF;
+	dst->direct = 0;
+	dst->mem = NULL;
+	dst->dirty = NULL;
+	dst->ndirty = -1;
+	dst->shared = 1;
+	dst->gen = 0;
+	dst->spans = NULL;
+	dst->spans_gen = dst->gen - 1; /* built after a repeat */
+	dst->spans_ok = 0;
+	dst->ring_x = 0;
+	dst->ring_y = 0;
+	if (src->parent)
+		src = src->parent;
 	src->img.used ++;
+	src->shared = 1; /* changes can not be tracked anymore */
+	src->ndirty = -1;
 	dst->img.used = 0; /* force do not free image */
 	luaL_getmetatable(to, "pixels metatable");
 	lua_setmetatable(to, -2);
@@ -2037,8 +5568,12 @@ gfx_udata_move(lua_State *from, int idx, lua_State *to)
 int
 luaopen_gfx(lua_State *L)
 {
+	blend_init();
 	pixels_create_meta(L);
 	font_create_meta(L);
+	cmdlist_create_meta(L);
+	tilemap_create_meta(L);
+	indexed_create_meta(L);
 	luaL_newlib(L, gfx_lib);
 	return 1;
 }
@@ -1,6 +1,7 @@
 typedef struct {
 	int w;
 	int h;
+	int stride; /* row pitch in pixels */
 	int clip_x1;
 	int clip_y1;
 	int clip_x2;
@@ -8,6 +9,8 @@ typedef struct {
 	int xoff;
 	int yoff;
 	int used;
+	int bpp; /* bytes per pixel: 4, or 1 for indexed */
+	int mode; /* blend mode of drawing, PXL_BLEND_BLEND or above */
 	unsigned char *ptr;
 } img_t;
 
@@ -15,18 +18,87 @@ extern img_t *img_new(int w, int h);
 extern void img_free(img_t *src);
 #define PXL_BLEND_COPY 1
 #define PXL_BLEND_BLEND 2
+#define PXL_BLEND_ADD 3
+#define PXL_BLEND_SUB 4
+#define PXL_BLEND_MUL 5
+#define PXL_BLEND_SCREEN 6
+#define PXL_BLEND_MIN 7
+#define PXL_BLEND_MAX 8
 
 extern int img_pixels_blend(img_t *src, int x, int y, int w, int h,
 	img_t *dst, int xx, int yy, int mode);
 
+static __inline void
+blend(unsigned char *s, unsigned char *d)
+{
+	unsigned int r, g, b, a;
+	unsigned int sa = s[3];
+	unsigned int da = d[3];
+	a = sa + (da * (255 - sa) >> 8);
+	r = ((unsigned int)s[0] * sa >> 8) +
+		((unsigned int)d[0] * da * (255 - sa) >> 16);
+	g = ((unsigned int)s[1] * sa >> 8) +
+		((unsigned int)d[1] * da * (255 - sa) >> 16);
+	b = ((unsigned int)s[2] * sa >> 8) +
+		((unsigned int)d[2] * da * (255 - sa) >> 16);
+	d[0] = r; d[1] = g; d[2] = b; d[3] = a;
+}
+
+static __inline void
+draw(unsigned char *s, unsigned char *d)
+{
+	unsigned int r, g, b, a;
+	unsigned int sa = s[3];
+	a = 255;
+	r = ((unsigned int)s[0] * sa >> 8) +
+		((unsigned int)d[0] * (255 - sa) >> 8);
+	g = ((unsigned int)s[1] * sa >> 8) +
+		((unsigned int)d[1] * (255 - sa) >> 8);
+	b = ((unsigned int)s[2] * sa >> 8) +
+		((unsigned int)d[2] * (255 - sa) >> 8);
+	d[0] = r; d[1] = g; d[2] = b; d[3] = a;
+}
+
+static __inline void
+pixel(unsigned char *s, unsigned char *d)
+{
+	unsigned char a_src = s[3];
+	unsigned char a_dst = d[3];
+	if (a_src == 255 || a_dst == 0) {
+		memcpy(d, s, 4);
+	} else if (a_src == 0) {
+		/* nothing to do */
+	} else if (a_dst == 255) {
+		draw(s, d);
+	} else {
+		blend(s, d);
+	}
+}
+
+/* row kernels, same result as pixel() for every pixel */
+extern void (*blend_row)(unsigned char *s, unsigned char *d, int w);
+extern void (*blend_fill_row)(unsigned char *col, unsigned char *d, int w);
+/* d = s * (mod + 1) >> 8 for every channel, tint and opacity */
+extern void (*mod_row)(unsigned char *s, unsigned char *d, int w, unsigned char *mod);
+/* PXL_BLEND_ADD and other modes */
+extern void (*blend_op_row)(unsigned char *s, unsigned char *d, int w, int mode);
+/* blend_row itself skips transparent and copies opaque groups */
+extern int blend_row_runs;
+extern void blend_init(void);
+extern const char *blend_renderer(void);
+
 struct _font_t;
 typedef struct _font_t font_t;
 
 extern font_t* font_load(const char *filename, float size);
 extern void font_free(font_t *font);
 extern int font_width(font_t *font, const char *text);
-extern int font_render(font_t *font, const char *text, img_t *img);
+extern int font_render(font_t *font, const char *text, img_t *img, int x, int y,
+	unsigned char *col);
 extern int font_height(font_t *font);
+extern img_t *font_run(font_t *font, const char *text, unsigned char *col);
+extern void font_cache(size_t budget, unsigned long *hits, unsigned long *misses,
+	size_t *used, size_t *max);
 const char *font_renderer(void);
 
 extern int gfx_udata_move(lua_State *from, int idx, lua_State *to);
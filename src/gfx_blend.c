@@ -0,0 +1,480 @@
+#include "external.h"
+#include "gfx.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BLEND_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+   All kernels compute both draw() and blend() results for a group
+   of pixels and then select per pixel exactly like pixel() does:
+   copy if sa == 255 or da == 0, keep if sa == 0, draw if da == 255,
+   blend otherwise. (d * da) fits in 16 bits, so the >> 16 of blend()
+   is a plain mulhi.
+*/
+
+static void
+blend_row_c(unsigned char *s, unsigned char *d, int w)
+{
+	while (w --) {
+		pixel(s, d);
+		s += 4;
+		d += 4;
+	}
+}
+
+static void
+blend_fill_row_c(unsigned char *col, unsigned char *d, int w)
+{
+	while (w --) {
+		pixel(col, d);
+		d += 4;
+	}
+}
+
+static void
+mod_row_c(unsigned char *s, unsigned char *d, int w, unsigned char *mod)
+{
+	int i;
+	for (i = 0; i < w * 4; i ++)
+		d[i] = s[i] * (mod[i & 3] + 1) >> 8;
+}
+
+/*
+   Blend modes weight the source by its alpha towards the value which
+   leaves the destination as is: t = s * sa for add, subtract, screen
+   and max, u = 255 - (255 - s) * sa for multiply and min. Alpha is
+   combined like in blend(). x * (y + 1) >> 8 keeps 255 exact.
+*/
+static __inline void
+op_px(unsigned char *s, unsigned char *d, int mode)
+{
+	unsigned int sa = s[3] + 1, t, u, i, r;
+	for (i = 0; i < 3; i++) {
+		t = s[i] * sa >> 8;
+		u = 255 - ((255 - s[i]) * sa >> 8);
+		switch (mode) {
+		case PXL_BLEND_ADD:
+			r = MIN(d[i] + t, 255);
+			break;
+		case PXL_BLEND_SUB:
+			r = (d[i] > t) ? d[i] - t : 0;
+			break;
+		case PXL_BLEND_MUL:
+			r = d[i] * (u + 1) >> 8;
+			break;
+		case PXL_BLEND_SCREEN:
+			r = 255 - ((255 - d[i]) * (256 - t) >> 8);
+			break;
+		case PXL_BLEND_MIN:
+			r = MIN(d[i], u);
+			break;
+		default:
+			r = MAX(d[i], t);
+			break;
+		}
+		d[i] = r;
+	}
+	d[3] += (255 - d[3]) * sa >> 8;
+}
+
+static void
+blend_op_row_c(unsigned char *s, unsigned char *d, int w, int mode)
+{
+	for (; w > 0; w --, s += 4, d += 4)
+		op_px(s, d, mode);
+}
+
+#ifdef BLEND_X86
+__attribute__((target("sse2"))) static __inline __m128i
+px2_sse2(__m128i s, __m128i d)
+{
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+	__m128i da = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d, 0xff), 0xff);
+	__m128i inv = _mm_sub_epi16(c255, sa);
+	__m128i sc = _mm_srli_epi16(_mm_mullo_epi16(s, sa), 8);
+	__m128i rd = _mm_add_epi16(sc,
+		_mm_srli_epi16(_mm_mullo_epi16(d, inv), 8));
+	__m128i rb = _mm_add_epi16(sc,
+		_mm_mulhi_epu16(_mm_mullo_epi16(d, da), inv));
+	__m128i ba = _mm_add_epi16(sa,
+		_mm_srli_epi16(_mm_mullo_epi16(da, inv), 8));
+	__m128i m, r;
+	rd = _mm_or_si128(_mm_and_si128(amask, d), _mm_andnot_si128(amask, rd));
+	rb = _mm_or_si128(_mm_and_si128(amask, ba), _mm_andnot_si128(amask, rb));
+	m = _mm_cmpeq_epi16(da, c255);
+	r = _mm_or_si128(_mm_and_si128(m, rd), _mm_andnot_si128(m, rb));
+	m = _mm_cmpeq_epi16(sa, _mm_setzero_si128());
+	r = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, r));
+	m = _mm_or_si128(_mm_cmpeq_epi16(sa, c255),
+		_mm_cmpeq_epi16(da, _mm_setzero_si128()));
+	return _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, r));
+}
+
+__attribute__((target("sse2"))) static __inline __m128i
+px4_sse2(__m128i s, __m128i d)
+{
+	const __m128i z = _mm_setzero_si128();
+	__m128i lo = px2_sse2(_mm_unpacklo_epi8(s, z), _mm_unpacklo_epi8(d, z));
+	__m128i hi = px2_sse2(_mm_unpackhi_epi8(s, z), _mm_unpackhi_epi8(d, z));
+	return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse2"))) static void
+blend_row_sse2(unsigned char *s, unsigned char *d, int w)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	const __m128i z = _mm_setzero_si128();
+	for (; w >= 4; w -= 4, s += 16, d += 16) {
+		__m128i vd, vs = _mm_loadu_si128((__m128i*)s);
+		int a = _mm_movemask_epi8(_mm_cmpeq_epi8(vs, ones)) & 0x8888;
+		if (a == 0x8888) {
+			_mm_storeu_si128((__m128i*)d, vs);
+			continue;
+		}
+		vd = _mm_loadu_si128((__m128i*)d);
+		a = _mm_movemask_epi8(_mm_cmpeq_epi8(vs, z)) & 0x8888;
+		if (a == 0x8888 && /* transparent over non-empty */
+			!(_mm_movemask_epi8(_mm_cmpeq_epi8(vd, z)) & 0x8888))
+			continue;
+		_mm_storeu_si128((__m128i*)d, px4_sse2(vs, vd));
+	}
+	blend_row_c(s, d, w);
+}
+
+__attribute__((target("sse2"))) static void
+blend_fill_row_sse2(unsigned char *col, unsigned char *d, int w)
+{
+	__m128i vs;
+	vs = _mm_set_epi8(col[3], col[2], col[1], col[0],
+		col[3], col[2], col[1], col[0],
+		col[3], col[2], col[1], col[0],
+		col[3], col[2], col[1], col[0]);
+	for (; w >= 4; w -= 4, d += 16)
+		_mm_storeu_si128((__m128i*)d,
+			px4_sse2(vs, _mm_loadu_si128((__m128i*)d)));
+	blend_fill_row_c(col, d, w);
+}
+
+__attribute__((target("sse2"))) static void
+mod_row_sse2(unsigned char *s, unsigned char *d, int w, unsigned char *mod)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i m = _mm_set_epi16(mod[3] + 1, mod[2] + 1, mod[1] + 1, mod[0] + 1,
+		mod[3] + 1, mod[2] + 1, mod[1] + 1, mod[0] + 1);
+	for (; w >= 4; w -= 4, s += 16, d += 16) {
+		__m128i vs = _mm_loadu_si128((__m128i*)s);
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(vs, z), m), 8);
+		__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(vs, z), m), 8);
+		_mm_storeu_si128((__m128i*)d, _mm_packus_epi16(lo, hi));
+	}
+	mod_row_c(s, d, w, mod);
+}
+
+/* op_px() for two pixels in 16 bit lanes */
+__attribute__((target("sse2"))) static __inline __m128i
+op2_sse2(__m128i s, __m128i d, int mode)
+{
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i sa = _mm_add_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff),
+		_mm_set1_epi16(1));
+	__m128i t = _mm_srli_epi16(_mm_mullo_epi16(s, sa), 8);
+	__m128i u = _mm_sub_epi16(c255,
+		_mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(c255, s), sa), 8));
+	__m128i r, a;
+	switch (mode) {
+	case PXL_BLEND_ADD:
+		r = _mm_min_epi16(_mm_add_epi16(d, t), c255);
+		break;
+	case PXL_BLEND_SUB:
+		r = _mm_subs_epu16(d, t);
+		break;
+	case PXL_BLEND_MUL:
+		r = _mm_srli_epi16(_mm_mullo_epi16(d,
+			_mm_add_epi16(u, _mm_set1_epi16(1))), 8);
+		break;
+	case PXL_BLEND_SCREEN:
+		r = _mm_sub_epi16(c255, _mm_srli_epi16(_mm_mullo_epi16(
+			_mm_sub_epi16(c255, d),
+			_mm_sub_epi16(_mm_set1_epi16(256), t)), 8));
+		break;
+	case PXL_BLEND_MIN:
+		r = _mm_min_epi16(d, u);
+		break;
+	default:
+		r = _mm_max_epi16(d, t);
+		break;
+	}
+	a = _mm_add_epi16(d, _mm_srli_epi16(_mm_mullo_epi16(
+		_mm_sub_epi16(c255, d), sa), 8));
+	return _mm_or_si128(_mm_and_si128(amask, a), _mm_andnot_si128(amask, r));
+}
+
+__attribute__((target("sse2"))) static void
+blend_op_row_sse2(unsigned char *s, unsigned char *d, int w, int mode)
+{
+	const __m128i z = _mm_setzero_si128();
+	for (; w >= 4; w -= 4, s += 16, d += 16) {
+		__m128i vs = _mm_loadu_si128((__m128i*)s);
+		__m128i vd = _mm_loadu_si128((__m128i*)d);
+		__m128i lo = op2_sse2(_mm_unpacklo_epi8(vs, z), _mm_unpacklo_epi8(vd, z), mode);
+		__m128i hi = op2_sse2(_mm_unpackhi_epi8(vs, z), _mm_unpackhi_epi8(vd, z), mode);
+		_mm_storeu_si128((__m128i*)d, _mm_packus_epi16(lo, hi));
+	}
+	blend_op_row_c(s, d, w, mode);
+}
+
+__attribute__((target("avx2"))) static __inline __m256i
+px4_avx2(__m256i s, __m256i d)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i amask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+		-1, 0, 0, 0, -1, 0, 0, 0);
+	__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+	__m256i da = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d, 0xff), 0xff);
+	__m256i inv = _mm256_sub_epi16(c255, sa);
+	__m256i sc = _mm256_srli_epi16(_mm256_mullo_epi16(s, sa), 8);
+	__m256i rd = _mm256_add_epi16(sc,
+		_mm256_srli_epi16(_mm256_mullo_epi16(d, inv), 8));
+	__m256i rb = _mm256_add_epi16(sc,
+		_mm256_mulhi_epu16(_mm256_mullo_epi16(d, da), inv));
+	__m256i ba = _mm256_add_epi16(sa,
+		_mm256_srli_epi16(_mm256_mullo_epi16(da, inv), 8));
+	__m256i r;
+	rd = _mm256_blendv_epi8(rd, d, amask);
+	rb = _mm256_blendv_epi8(rb, ba, amask);
+	r = _mm256_blendv_epi8(rb, rd, _mm256_cmpeq_epi16(da, c255));
+	r = _mm256_blendv_epi8(r, d,
+		_mm256_cmpeq_epi16(sa, _mm256_setzero_si256()));
+	return _mm256_blendv_epi8(r, s,
+		_mm256_or_si256(_mm256_cmpeq_epi16(sa, c255),
+		_mm256_cmpeq_epi16(da, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2"))) static __inline __m256i
+px8_avx2(__m256i s, __m256i d)
+{
+	const __m256i z = _mm256_setzero_si256();
+	__m256i lo = px4_avx2(_mm256_unpacklo_epi8(s, z), _mm256_unpacklo_epi8(d, z));
+	__m256i hi = px4_avx2(_mm256_unpackhi_epi8(s, z), _mm256_unpackhi_epi8(d, z));
+	return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2"))) static void
+blend_row_avx2(unsigned char *s, unsigned char *d, int w)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+	const __m256i z = _mm256_setzero_si256();
+	for (; w >= 8; w -= 8, s += 32, d += 32) {
+		__m256i vd, vs = _mm256_loadu_si256((__m256i*)s);
+		unsigned int a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(vs, ones));
+		if ((a & 0x88888888) == 0x88888888) {
+			_mm256_storeu_si256((__m256i*)d, vs);
+			continue;
+		}
+		vd = _mm256_loadu_si256((__m256i*)d);
+		a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(vs, z));
+		if ((a & 0x88888888) == 0x88888888 &&
+			!(_mm256_movemask_epi8(_mm256_cmpeq_epi8(vd, z)) & 0x88888888))
+			continue;
+		_mm256_storeu_si256((__m256i*)d, px8_avx2(vs, vd));
+	}
+	blend_row_sse2(s, d, w);
+}
+
+__attribute__((target("avx2"))) static void
+blend_fill_row_avx2(unsigned char *col, unsigned char *d, int w)
+{
+	__m256i vs;
+	unsigned int c;
+	memcpy(&c, col, 4);
+	vs = _mm256_set1_epi32(c);
+	for (; w >= 8; w -= 8, d += 32)
+		_mm256_storeu_si256((__m256i*)d,
+			px8_avx2(vs, _mm256_loadu_si256((__m256i*)d)));
+	blend_fill_row_sse2(col, d, w);
+}
+#endif
+
+#ifdef BLEND_NEON
+static __inline uint8x8x4_t
+px8_neon(uint8x8x4_t s, uint8x8x4_t d)
+{
+	uint8x8x4_t r;
+	uint16x8_t sa = vmovl_u8(s.val[3]);
+	uint16x8_t da = vmovl_u8(d.val[3]);
+	uint16x8_t inv = vsubq_u16(vdupq_n_u16(255), sa);
+	uint8x8_t m_copy = vorr_u8(vceq_u8(s.val[3], vdup_n_u8(255)),
+		vceq_u8(d.val[3], vdup_n_u8(0)));
+	uint8x8_t m_keep = vceq_u8(s.val[3], vdup_n_u8(0));
+	uint8x8_t m_draw = vceq_u8(d.val[3], vdup_n_u8(255));
+	uint8x8_t ba = vmovn_u16(vaddq_u16(sa,
+		vshrq_n_u16(vmulq_u16(da, inv), 8)));
+	int i;
+	for (i = 0; i < 3; i++) {
+		uint16x8_t s16 = vmovl_u8(s.val[i]);
+		uint16x8_t d16 = vmovl_u8(d.val[i]);
+		uint16x8_t sc = vshrq_n_u16(vmulq_u16(s16, sa), 8);
+		uint16x8_t dd = vmulq_u16(d16, da);
+		uint16x8_t db = vcombine_u16(
+			vshrn_n_u32(vmull_u16(vget_low_u16(dd), vget_low_u16(inv)), 16),
+			vshrn_n_u32(vmull_u16(vget_high_u16(dd), vget_high_u16(inv)), 16));
+		uint8x8_t rd = vmovn_u16(vaddq_u16(sc,
+			vshrq_n_u16(vmulq_u16(d16, inv), 8)));
+		uint8x8_t rb = vmovn_u16(vaddq_u16(sc, db));
+		r.val[i] = vbsl_u8(m_draw, rd, rb);
+		r.val[i] = vbsl_u8(m_keep, d.val[i], r.val[i]);
+		r.val[i] = vbsl_u8(m_copy, s.val[i], r.val[i]);
+	}
+	r.val[3] = vbsl_u8(m_draw, d.val[3], ba);
+	r.val[3] = vbsl_u8(m_keep, d.val[3], r.val[3]);
+	r.val[3] = vbsl_u8(m_copy, s.val[3], r.val[3]);
+	return r;
+}
+
+static void
+blend_row_neon(unsigned char *s, unsigned char *d, int w)
+{
+	for (; w >= 8; w -= 8, s += 32, d += 32) {
+		uint8x8x4_t vd, vs = vld4_u8(s);
+		uint64_t a = vget_lane_u64(vreinterpret_u64_u8(vs.val[3]), 0);
+		if (a == ~(uint64_t)0) {
+			memcpy(d, s, 32);
+			continue;
+		}
+		vd = vld4_u8(d);
+		if (!a && !vget_lane_u64(vreinterpret_u64_u8(
+				vceq_u8(vd.val[3], vdup_n_u8(0))), 0))
+			continue; /* transparent over non-empty */
+		vst4_u8(d, px8_neon(vs, vd));
+	}
+	blend_row_c(s, d, w);
+}
+
+static void
+blend_fill_row_neon(unsigned char *col, unsigned char *d, int w)
+{
+	uint8x8x4_t vs;
+	vs.val[0] = vdup_n_u8(col[0]);
+	vs.val[1] = vdup_n_u8(col[1]);
+	vs.val[2] = vdup_n_u8(col[2]);
+	vs.val[3] = vdup_n_u8(col[3]);
+	for (; w >= 8; w -= 8, d += 32)
+		vst4_u8(d, px8_neon(vs, vld4_u8(d)));
+	blend_fill_row_c(col, d, w);
+}
+
+static void
+mod_row_neon(unsigned char *s, unsigned char *d, int w, unsigned char *mod)
+{
+	int i;
+	for (; w >= 8; w -= 8, s += 32, d += 32) {
+		uint8x8x4_t v = vld4_u8(s);
+		for (i = 0; i < 4; i++)
+			v.val[i] = vshrn_n_u16(vmulq_n_u16(vmovl_u8(v.val[i]),
+				mod[i] + 1), 8);
+		vst4_u8(d, v);
+	}
+	mod_row_c(s, d, w, mod);
+}
+
+static void
+blend_op_row_neon(unsigned char *s, unsigned char *d, int w, int mode)
+{
+	int i;
+	const uint16x8_t c255 = vdupq_n_u16(255);
+	for (; w >= 8; w -= 8, s += 32, d += 32) {
+		uint8x8x4_t vs = vld4_u8(s);
+		uint8x8x4_t vd = vld4_u8(d);
+		uint16x8_t sa = vaddq_u16(vmovl_u8(vs.val[3]), vdupq_n_u16(1));
+		uint16x8_t da = vmovl_u8(vd.val[3]);
+		for (i = 0; i < 3; i++) {
+			uint16x8_t sc = vmovl_u8(vs.val[i]);
+			uint16x8_t dc = vmovl_u8(vd.val[i]);
+			uint16x8_t t = vshrq_n_u16(vmulq_u16(sc, sa), 8);
+			uint16x8_t u = vsubq_u16(c255,
+				vshrq_n_u16(vmulq_u16(vsubq_u16(c255, sc), sa), 8));
+			uint16x8_t r;
+			switch (mode) {
+			case PXL_BLEND_ADD:
+				r = vminq_u16(vaddq_u16(dc, t), c255);
+				break;
+			case PXL_BLEND_SUB:
+				r = vqsubq_u16(dc, t);
+				break;
+			case PXL_BLEND_MUL:
+				r = vshrq_n_u16(vmulq_u16(dc, vaddq_u16(u, vdupq_n_u16(1))), 8);
+				break;
+			case PXL_BLEND_SCREEN:
+				r = vsubq_u16(c255, vshrq_n_u16(vmulq_u16(vsubq_u16(c255, dc),
+					vsubq_u16(vdupq_n_u16(256), t)), 8));
+				break;
+			case PXL_BLEND_MIN:
+				r = vminq_u16(dc, u);
+				break;
+			default:
+				r = vmaxq_u16(dc, t);
+				break;
+			}
+			vd.val[i] = vmovn_u16(r);
+		}
+		vd.val[3] = vmovn_u16(vaddq_u16(da,
+			vshrq_n_u16(vmulq_u16(vsubq_u16(c255, da), sa), 8)));
+		vst4_u8(d, vd);
+	}
+	blend_op_row_c(s, d, w, mode);
+}
+#endif
+
+void (*blend_row)(unsigned char *s, unsigned char *d, int w) = blend_row_c;
+void (*blend_fill_row)(unsigned char *col, unsigned char *d, int w) = blend_fill_row_c;
+void (*mod_row)(unsigned char *s, unsigned char *d, int w, unsigned char *mod) = mod_row_c;
+void (*blend_op_row)(unsigned char *s, unsigned char *d, int w, int mode) = blend_op_row_c;
+
+int blend_row_runs = 0;
+static const char *info = "c";
+
+void
+blend_init(void)
+{
+#if defined(BLEND_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		blend_row = blend_row_avx2;
+		blend_fill_row = blend_fill_row_avx2;
+		mod_row = mod_row_sse2;
+		blend_op_row = blend_op_row_sse2;
+		blend_row_runs = 1;
+		info = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		blend_row = blend_row_sse2;
+		blend_fill_row = blend_fill_row_sse2;
+		mod_row = mod_row_sse2;
+		blend_op_row = blend_op_row_sse2;
+		blend_row_runs = 1;
+		info = "sse2";
+	}
+#elif defined(BLEND_NEON)
+	blend_row = blend_row_neon;
+	blend_fill_row = blend_fill_row_neon;
+	mod_row = mod_row_neon;
+	blend_op_row = blend_op_row_neon;
+	blend_row_runs = 1;
+	info = "neon";
+#endif
+}
+
+const char *
+blend_renderer(void)
+{
+	return info;
+}
@@ -4,67 +4,377 @@
 #include "gfx.h"
 
 #define MAX_GLYPHSET 256
+#define ATLAS_SIZE 256 /* side of atlas page */
+#define ATLAS_PAGES 16
+#define KERN_HASH 256 /* first size of kerning table */
+#define KERN_MAX 65536 /* the table is cleared, not grown, above */
 
+/* skyline segment: used area of x - x + w ends at y */
 typedef struct {
-	img_t *image;
-	stbtt_bakedchar glyphs[256];
-} glyphset_t;
+	int x;
+	int y;
+	int w;
+} sky_t;
+
+/* 8-bit coverage page shared by all fonts, reused when it is the
+   least recently used one and there is no place */
+typedef struct {
+	unsigned char *ptr;
+	int w;
+	int h;
+	unsigned int gen; /* bumped when the page is cleared */
+	unsigned long stamp; /* last use */
+	int nsky;
+	sky_t *sky;
+} atlas_t;
+
+/* TrueType glyph, metrics are loaded and the bitmap is placed in
+   atlas on first use */
+typedef struct {
+	unsigned codepoint;
+	int loaded;
+	int xadvance;
+	int xoff;
+	int yoff;
+	int w;
+	int h;
+	atlas_t *page; /* valid while gen is the same */
+	unsigned int gen;
+	int x;
+	int y;
+} glyph_t;
+
+/* scaled kerning of pair a, b; a == 0 is a free slot */
+typedef struct {
+	unsigned a;
+	unsigned b;
+	int kern;
+} kern_t;
+
+static atlas_t *atlas[ATLAS_PAGES];
+static unsigned long atlas_clock;
+
+/* glyph of .fnt font: mask in font->bits, rows of (w + 7) / 8 bytes */
+typedef struct {
+	int w;
+	int h;
+	int off;
+} fnt_glyph_t;
 
 struct _font_t {
 	void *data;
 	stbtt_fontinfo stbfont;
-	glyphset_t *sets[MAX_GLYPHSET];
+	glyph_t *glyphs[MAX_GLYPHSET]; /* 256 glyphs each */
 	float size;
+	float scale;
+	float glyph_scale; /* as baked glyphs had, keeps old metrics */
+	int ascent; /* scaled */
 	int height;
+	kern_t *kerns; /* open addressing, nkerns of kern_size are used */
+	int nkerns;
+	int kern_size;
+	unsigned char *bits; /* 1-bit masks of all glyphs of .fnt font */
+	fnt_glyph_t *pages[MAX_GLYPHSET]; /* 256 glyphs each */
 };
 
-static glyphset_t*
-load_glyphset(font_t *font, int idx)
-{
-	unsigned char col[4] = { 255, 255, 255, 255 };
-	int w = 128, h = 128, i;
-	float s;
-	int ascent, descent, linegap;
-	int res;
-	unsigned char c;
-	glyphset_t *set = calloc(1, sizeof(glyphset_t));
-retry:
-	set->image = img_new(w, h);
-	s = stbtt_ScaleForMappingEmToPixels(&font->stbfont, 1) /
-		stbtt_ScaleForPixelHeight(&font->stbfont, 1);
-	res = stbtt_BakeFontBitmap(font->data, 0,
-				   font->size * s,
-				   (void*)set->image->ptr,
-				   w, h, idx * 256, 256, set->glyphs);
-	if (res < 0) {
-		w *= 2;
-		h *= 2;
-		free(set->image);
-		goto retry;
+static fnt_glyph_t *
+fnt_glyph(font_t *font, unsigned codepoint)
+{
+	fnt_glyph_t *page;
+	if (codepoint >= MAX_GLYPHSET * 256)
+		return NULL;
+	page = font->pages[codepoint >> 8];
+	return (page && page[codepoint & 0xff].off >= 0) ?
+		&page[codepoint & 0xff] : NULL;
+}
+
+/* next line after p, l and len are the line without line end */
+static const char *
+fnt_line(const char *p, const char *end, const char **l, int *len)
+{
+	const char *e = memchr(p, '\n', end - p);
+	if (!e)
+		e = end;
+	*l = p;
+	*len = e - p;
+	if (*len && p[*len - 1] == '\r')
+		(*len) --;
+	return (e < end) ? e + 1 : end;
+}
+
+static int
+fnt_blank(const char *l, int len)
+{
+	for (; len > 0; len --, l ++) {
+		if (*l != ' ' && *l != '\t')
+			return 0;
 	}
-	stbtt_GetFontVMetrics(&font->stbfont, &ascent, &descent, &linegap);
-	s = stbtt_ScaleForMappingEmToPixels(&font->stbfont, font->size);
-	int scaled_ascent = ascent * s + 0.5;
-	for (i = 0; i < 256; i++) {
-		set->glyphs[i].yoff += scaled_ascent;
-		set->glyphs[i].xadvance = ceil(set->glyphs[i].xadvance);
+	return 1;
+}
+
+/* "0x41" line, -1 if it is not a codepoint */
+static long
+fnt_codepoint(const char *l, int len)
+{
+	char buf[32], *e;
+	long cp;
+	while (len > 0 && (*l == ' ' || *l == '\t')) {
+		l ++;
+		len --;
 	}
-	for (i = w * h - 1; i >= 0; i--) {
-		c = *(set->image->ptr + i);
-		col[3] = c;
-		memcpy(set->image->ptr + i * 4, col, 4);
+	while (len > 0 && (l[len - 1] == ' ' || l[len - 1] == '\t'))
+		len --;
+	if (len < 3 || len >= sizeof(buf) || l[0] != '0' || l[1] != 'x')
+		return -1;
+	memcpy(buf, l, len);
+	buf[len] = 0;
+	cp = strtol(buf + 2, &e, 16);
+	return (*e || cp < 0) ? -1 : cp;
+}
+
+/*
+   .fnt is text: "0x41" line starts a glyph, next lines up to an empty
+   one are its rows, where '-' and ' ' are empty pixels. All masks
+   are packed into one bit buffer.
+*/
+static int
+fnt_load(font_t *font, const char *text, size_t size)
+{
+	const char *p = text, *end = text + size, *rows, *l;
+	int len, w, h, x, y, i, pitch, alloc = 0, used = 0;
+	long cp;
+	unsigned char *bits;
+	fnt_glyph_t *page;
+	while (p < end) {
+		p = fnt_line(p, end, &l, &len);
+		cp = fnt_codepoint(l, len);
+		if (cp < 0 || cp >= MAX_GLYPHSET * 256)
+			continue;
+		rows = p;
+		for (w = 0, h = 0; p < end; h ++) {
+			p = fnt_line(p, end, &l, &len);
+			if (fnt_blank(l, len))
+				break;
+			w = MAX(w, len);
+		}
+		pitch = (w + 7) / 8;
+		if (used + pitch * h > alloc) {
+			alloc = MAX(alloc * 2, used + pitch * h + 4096);
+			if (!(bits = realloc(font->bits, alloc)))
+				return -1;
+			font->bits = bits;
+		}
+		if (!(page = font->pages[cp >> 8])) {
+			if (!(page = malloc(256 * sizeof(fnt_glyph_t))))
+				return -1;
+			for (i = 0; i < 256; i++)
+				page[i].off = -1;
+			font->pages[cp >> 8] = page;
+		}
+		page += cp & 0xff;
+		page->w = w;
+		page->h = h;
+		page->off = used;
+		bits = font->bits + used;
+		memset(bits, 0, pitch * h);
+		for (y = 0; y < h; y ++, bits += pitch) {
+			rows = fnt_line(rows, end, &l, &len);
+			for (x = 0; x < len; x++) {
+				if (l[x] != '-' && l[x] != ' ')
+					bits[x >> 3] |= 0x80 >> (x & 7);
+			}
+		}
+		used += pitch * h;
+		font->height = MAX(font->height, h);
 	}
-	return set;
+	if (!font->bits) /* no glyphs */
+		font->bits = malloc(1);
+	return font->bits ? 0 : -1;
+}
+
+static glyph_t *
+font_glyph(font_t *font, unsigned codepoint)
+{
+	glyph_t **page = &font->glyphs[(codepoint >> 8) % MAX_GLYPHSET], *g;
+	int adv, lsb, x0, y0, x1, y1;
+	if (!*page && !(*page = calloc(256, sizeof(glyph_t))))
+		return NULL;
+	g = &(*page)[codepoint & 0xff];
+	if (g->loaded && g->codepoint == codepoint)
+		return g;
+	stbtt_GetCodepointHMetrics(&font->stbfont, codepoint, &adv, &lsb);
+	stbtt_GetCodepointBitmapBox(&font->stbfont, codepoint,
+		font->glyph_scale, font->glyph_scale, &x0, &y0, &x1, &y1);
+	g->codepoint = codepoint;
+	g->loaded = 1;
+	g->xadvance = ceil(adv * font->glyph_scale);
+	g->xoff = x0;
+	g->yoff = y0 + font->ascent;
+	g->w = x1 - x0;
+	g->h = y1 - y0;
+	g->page = NULL;
+	return g;
 }
 
-static glyphset_t*
-get_glyphset(font_t *font, int codepoint)
+static kern_t *
+kern_slot(kern_t *kerns, int size, unsigned a, unsigned b)
 {
-	int idx = (codepoint >> 8) % MAX_GLYPHSET;
-	if (!font->sets[idx]) {
-		font->sets[idx] = load_glyphset(font, idx);
+	unsigned h = (a * 31 + b) * 2654435761u;
+	kern_t *k;
+	for (h &= size - 1; (k = &kerns[h])->a; h = (h + 1) & (size - 1)) {
+		if (k->a == a && k->b == b)
+			break;
 	}
-	return font->sets[idx];
+	return k;
+}
+
+/* scaled kerning of pair, asked from the font once */
+static int
+font_kern(font_t *font, unsigned a, unsigned b)
+{
+	kern_t *k, *kerns;
+	int i, size, kern;
+	if (!font->stbfont.kern && !font->stbfont.gpos)
+		return 0;
+	if (font->kerns) {
+		k = kern_slot(font->kerns, font->kern_size, a, b);
+		if (k->a)
+			return k->kern;
+	}
+	kern = ceil(stbtt_GetCodepointKernAdvance(&font->stbfont, a, b) * font->scale);
+	if (font->nkerns * 2 >= font->kern_size) { /* grow or clear */
+		size = font->kern_size ? font->kern_size * 2 : KERN_HASH;
+		if (size > KERN_MAX) {
+			size = font->kern_size;
+			memset(font->kerns, 0, size * sizeof(kern_t));
+			font->nkerns = 0;
+		} else {
+			if (!(kerns = calloc(size, sizeof(kern_t))))
+				return kern;
+			for (i = 0; i < font->kern_size; i++) {
+				if (font->kerns[i].a)
+					*kern_slot(kerns, size, font->kerns[i].a,
+						font->kerns[i].b) = font->kerns[i];
+			}
+			free(font->kerns);
+			font->kerns = kerns;
+			font->kern_size = size;
+		}
+	}
+	k = kern_slot(font->kerns, font->kern_size, a, b);
+	k->a = a;
+	k->b = b;
+	k->kern = kern;
+	font->nkerns ++;
+	return kern;
+}
+
+static int
+atlas_clear(atlas_t *a, int w, int h)
+{
+	unsigned char *ptr;
+	sky_t *sky;
+	if (w > a->w || h > a->h) { /* for a big glyph */
+		if (!(ptr = realloc(a->ptr, w * h)))
+			return -1;
+		a->ptr = ptr;
+		if (!(sky = realloc(a->sky, w * sizeof(sky_t))))
+			return -1;
+		a->sky = sky;
+		a->w = w;
+		a->h = h;
+	}
+	a->gen ++;
+	a->nsky = 1;
+	a->sky[0].x = 0;
+	a->sky[0].y = 0;
+	a->sky[0].w = a->w;
+	return 0;
+}
+
+/* lowest place for w x h, index of its first segment or -1 */
+static int
+sky_fit(atlas_t *a, int w, int h, int *px, int *py)
+{
+	int i, j, x, y, best = -1;
+	*py = a->h;
+	for (i = 0; i < a->nsky; i++) {
+		x = a->sky[i].x;
+		if (x + w > a->w)
+			break;
+		for (y = 0, j = i; j < a->nsky && a->sky[j].x < x + w; j++)
+			y = MAX(y, a->sky[j].y);
+		if (y + h <= a->h && y < *py) {
+			best = i;
+			*px = x;
+			*py = y;
+		}
+	}
+	return best;
+}
+
+/* w x h is taken at segment i */
+static void
+sky_add(atlas_t *a, int i, int w, int h, int y)
+{
+	int j, x = a->sky[i].x;
+	for (j = i; j < a->nsky && a->sky[j].x + a->sky[j].w <= x + w; j++);
+	if (j < a->nsky && a->sky[j].x < x + w) { /* partly covered */
+		a->sky[j].w -= x + w - a->sky[j].x;
+		a->sky[j].x = x + w;
+	}
+	memmove(&a->sky[i + 1], &a->sky[j], (a->nsky - j) * sizeof(sky_t));
+	a->nsky += 1 - (j - i);
+	a->sky[i].x = x;
+	a->sky[i].y = y + h;
+	a->sky[i].w = w;
+	for (j = 0; j < a->nsky - 1; ) { /* merge same heights */
+		if (a->sky[j].y != a->sky[j + 1].y) {
+			j ++;
+			continue;
+		}
+		a->sky[j].w += a->sky[j + 1].w;
+		memmove(&a->sky[j + 1], &a->sky[j + 2], (a->nsky - j - 2) * sizeof(sky_t));
+		a->nsky --;
+	}
+}
+
+/* rasterize glyph into atlas if it is not there, NULL if no memory */
+static atlas_t *
+glyph_place(font_t *font, glyph_t *g)
+{
+	atlas_t *a;
+	int i, k = -1, x = 0, y = 0, lru = 0;
+	int w = MAX(ATLAS_SIZE, g->w), h = MAX(ATLAS_SIZE, g->h);
+	if (g->page && g->gen == g->page->gen) {
+		g->page->stamp = ++ atlas_clock;
+		return g->page;
+	}
+	for (i = 0; i < ATLAS_PAGES && atlas[i]; i++) {
+		if ((k = sky_fit(atlas[i], g->w, g->h, &x, &y)) >= 0)
+			break;
+		if (atlas[i]->stamp < atlas[lru]->stamp)
+			lru = i;
+	}
+	if (k < 0) {
+		if (i == ATLAS_PAGES) /* all are full */
+			i = lru;
+		else if (!(atlas[i] = calloc(1, sizeof(atlas_t))))
+			return NULL;
+		if (atlas_clear(atlas[i], w, h))
+			return NULL;
+		k = sky_fit(atlas[i], g->w, g->h, &x, &y);
+	}
+	a = atlas[i];
+	sky_add(a, k, g->w, g->h, y);
+	stbtt_MakeCodepointBitmap(&font->stbfont, a->ptr + y * a->w + x,
+		g->w, g->h, a->w, font->glyph_scale, font->glyph_scale, g->codepoint);
+	g->page = a;
+	g->gen = a->gen;
+	g->x = x;
+	g->y = y;
+	a->stamp = ++ atlas_clock;
+	return a;
 }
 
 int
@@ -73,23 +383,32 @@ font_height(font_t *font)
 	return font->height;
 }
 
-int
-font_width(font_t *font, const char *text)
+static int
+text_width(font_t *font, const char *text)
 {
 	int x = 0;
 	const char *p = text;
 	unsigned codepoint, ocp = 0;
-	int xend = 0, kern = 0;
-	float s = stbtt_ScaleForMappingEmToPixels(&font->stbfont, font->size);
+	int xend = 0;
+	glyph_t *g;
+	fnt_glyph_t *fg;
+	if (font->bits) { /* .fnt, missing glyphs are skipped */
+		while (*p) {
+			p = utf8_to_codepoint(p, &codepoint);
+			if ((fg = fnt_glyph(font, codepoint)))
+				x += fg->w;
+		}
+		return x;
+	}
 	while (*p) {
 		p = utf8_to_codepoint(p, &codepoint);
-		glyphset_t *set = get_glyphset(font, codepoint);
-		stbtt_bakedchar *g = &set->glyphs[codepoint & 0xff];
+		if (!(g = font_glyph(font, codepoint)))
+			continue;
 		if (ocp)
-			kern = stbtt_GetCodepointKernAdvance(&font->stbfont, ocp, codepoint);
+			x += font_kern(font, ocp, codepoint);
 		ocp = codepoint;
-		x += g->xadvance + ceil(kern * s);
-		xend = g->xoff + g->x1 - g->x0;
+		x += g->xadvance;
+		xend = g->xoff + g->w;
 		if (xend > g->xadvance)
 			xend -= g->xadvance;
 		else
@@ -107,6 +426,8 @@ font_load(const char *filename, float size)
 	font_t *font = NULL;
 	FILE *fp = NULL;
 	long fsize;
+	size_t len;
+	int fnt;
 	font = malloc(sizeof(font_t));
 	if (!font)
 		goto err;
@@ -120,6 +441,13 @@ font_load(const char *filename, float size)
 	fsize = ftell(fp);
 	if (fsize < 0)
 		goto err;
+	len = strlen(filename);
+	fnt = len > 4 && filename[len - 4] == '.' &&
+		tolower((unsigned char)filename[len - 3]) == 'f' &&
+		tolower((unsigned char)filename[len - 2]) == 'n' &&
+		tolower((unsigned char)filename[len - 1]) == 't';
+	if (!fnt && size <= 0)
+		goto err;
 	if (fseek(fp, 0, SEEK_SET) < 0)
 		goto err;
 	font->data = malloc(fsize);
@@ -128,62 +456,314 @@ font_load(const char *filename, float size)
 	if (fread(font->data, 1, fsize, fp) != fsize)
 		goto err;
 	fclose(fp); fp = NULL;
+	if (fnt) { /* bitmap font, size is not used */
+		ok = !fnt_load(font, font->data, fsize);
+		free(font->data);
+		font->data = NULL;
+		if (!ok)
+			goto err;
+		return font;
+	}
 	ok = stbtt_InitFont(&font->stbfont, font->data, 0);
 	if (!ok)
 		goto err;
 	stbtt_GetFontVMetrics(&font->stbfont, &ascent, &descent, &linegap);
 	scale = stbtt_ScaleForMappingEmToPixels(&font->stbfont, size);
 	font->height = (ascent - descent + linegap) * scale + 0.5;
+	font->scale = scale;
+	font->glyph_scale = stbtt_ScaleForPixelHeight(&font->stbfont,
+		size * stbtt_ScaleForMappingEmToPixels(&font->stbfont, 1) /
+		stbtt_ScaleForPixelHeight(&font->stbfont, 1));
+	font->ascent = ascent * scale + 0.5;
 	return font;
 err:
 	if (fp)
 		fclose(fp);
-	if (font && font->data)
-		free(font->data);
-	free(font);
+	if (font)
+		font_free(font);
 	return NULL;
 }
 
+/* coverage w x h of atlas page at xx, yy of dst in color col, clipped */
+static void
+glyph_blend(atlas_t *a, int x, int y, int w, int h,
+	img_t *dst, int xx, int yy, unsigned char *col)
+{
+	unsigned char row[64 * 4], *s, *d;
+	unsigned int ca = col[3] + 1;
+	int cy, cx, n, i, dx1, dy1, cw, ch;
+	dx1 = MAX(dst->clip_x1 - xx, 0);
+	dy1 = MAX(dst->clip_y1 - yy, 0);
+	cw = MIN(xx + w, dst->clip_x2) - xx - dx1;
+	ch = MIN(yy + h, dst->clip_y2) - yy - dy1;
+	if (cw <= 0 || ch <= 0)
+		return;
+	for (i = 0; i < 64; i++)
+		memcpy(row + i * 4, col, 3);
+	for (cy = dy1; cy < dy1 + ch; cy ++) {
+		s = a->ptr + (y + cy) * a->w + x + dx1;
+		d = dst->ptr + ((yy + cy) * dst->stride + xx + dx1) * 4;
+		for (cx = 0; cx < cw; cx += n) {
+			n = MIN(cw - cx, 64);
+			for (i = 0; i < n; i++)
+				row[i * 4 + 3] = s[cx + i] * ca >> 8;
+			if (dst->mode > PXL_BLEND_BLEND)
+				blend_op_row(row, d + cx * 4, n, dst->mode);
+			else
+				blend_row(row, d + cx * 4, n);
+		}
+	}
+}
+
+/* mask of .fnt glyph at xx, yy of dst, clipped */
+static void
+fnt_glyph_blend(font_t *font, fnt_glyph_t *g, img_t *dst, int xx, int yy,
+	unsigned char *col)
+{
+	int x, y, x1, x2, y2, pitch = (g->w + 7) / 8;
+	unsigned char *bits, *d;
+	x1 = MAX(dst->clip_x1 - xx, 0);
+	x2 = MIN(g->w, dst->clip_x2 - xx);
+	y2 = MIN(g->h, dst->clip_y2 - yy);
+	for (y = MAX(dst->clip_y1 - yy, 0); y < y2; y ++) {
+		bits = font->bits + g->off + y * pitch;
+		d = dst->ptr + ((yy + y) * dst->stride + xx) * 4;
+		for (x = x1; x < x2; x ++) {
+			if (!(bits[x >> 3] & (0x80 >> (x & 7))))
+				continue;
+			if (dst->mode > PXL_BLEND_BLEND)
+				blend_op_row(col, d + x * 4, 1, dst->mode);
+			else
+				pixel(col, d + x * 4);
+		}
+	}
+}
+
+/* text at x, y of img in color col, clipped by img clip */
 int
-font_render(font_t *font, const char *text, img_t *img)
+font_render(font_t *font, const char *text, img_t *img, int x, int y,
+	unsigned char *col)
 {
-	int x = 0, kern = 0;
 	unsigned codepoint, ocp = 0;
-	glyphset_t *set;
-	stbtt_bakedchar *g;
-	float s = stbtt_ScaleForMappingEmToPixels(&font->stbfont, font->size);
+	glyph_t *g;
+	atlas_t *a;
+	fnt_glyph_t *fg;
 	const char *p;
 	p = text;
+	if (font->bits) {
+		while (*p) {
+			p = utf8_to_codepoint(p, &codepoint);
+			if (!(fg = fnt_glyph(font, codepoint)))
+				continue;
+			fnt_glyph_blend(font, fg, img, x, y, col);
+			x += fg->w;
+		}
+		return 0;
+	}
 	while (*p) {
 		p = utf8_to_codepoint(p, &codepoint);
-		set = get_glyphset(font, codepoint);
-		g = &set->glyphs[codepoint & 0xff];
+		if (!(g = font_glyph(font, codepoint)))
+			continue;
 		if (ocp)
-			kern = stbtt_GetCodepointKernAdvance(&font->stbfont, ocp, codepoint);
+			x += font_kern(font, ocp, codepoint);
 		ocp = codepoint;
-		x += ceil(s * kern);
-		if (g->x1 - g->x0 > 0 && g->y1 - g->y0 > 0) {
-			img_pixels_blend(set->image,
-				g->x0, g->y0,
-				g->x1 - g->x0, g->y1 - g->y0,
-				img, x + g->xoff, g->yoff, PXL_BLEND_BLEND);
-		}
+		if (g->w > 0 && g->h > 0 && (a = glyph_place(font, g)))
+			glyph_blend(a, g->x, g->y, g->w, g->h,
+				img, x + g->xoff, y + g->yoff, col);
 		x += g->xadvance;
 	}
 	return 0;
 }
 
+/*
+   LRU cache of text runs: widths and rendered bitmaps keyed by font
+   (so by size too), text and color. Fonts live in the main thread
+   only, so there is no locking.
+*/
+#define RUN_HASH 1024
+
+typedef struct _run_t {
+	struct _run_t *prev; /* more recent */
+	struct _run_t *next;
+	struct _run_t *hnext;
+	font_t *font;
+	unsigned int hash;
+	int width;
+	int colored; /* col and img are set */
+	unsigned char col[4];
+	img_t *img;
+	size_t size;
+	char text[1];
+} run_t;
+
+static run_t *run_hash[RUN_HASH];
+static run_t *run_head, *run_tail;
+static size_t run_used, run_budget = 4 * 1024 * 1024;
+static unsigned long run_hits, run_misses;
+
+static unsigned int
+run_key(font_t *font, const char *text)
+{
+	unsigned int h = 2166136261u ^ (unsigned int)(size_t)font;
+	for (; *text; text ++)
+		h = (h ^ (unsigned char)*text) * 16777619u;
+	return h;
+}
+
+static void
+run_free(run_t *r)
+{
+	run_t **p = &run_hash[r->hash % RUN_HASH];
+	while (*p != r)
+		p = &(*p)->hnext;
+	*p = r->hnext;
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		run_head = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		run_tail = r->prev;
+	run_used -= r->size;
+	if (r->img)
+		img_free(r->img);
+	free(r);
+}
+
+/* col is NULL for any color */
+static run_t *
+run_find(font_t *font, const char *text, unsigned int hash, unsigned char *col)
+{
+	run_t *r;
+	for (r = run_hash[hash % RUN_HASH]; r; r = r->hnext) {
+		if (r->hash != hash || r->font != font || strcmp(r->text, text))
+			continue;
+		if (col && (!r->colored || memcmp(r->col, col, 4)))
+			continue;
+		if (r != run_head) { /* to front */
+			r->prev->next = r->next;
+			if (r->next)
+				r->next->prev = r->prev;
+			else
+				run_tail = r->prev;
+			r->prev = NULL;
+			r->next = run_head;
+			run_head->prev = r;
+			run_head = r;
+		}
+		run_hits ++;
+		return r;
+	}
+	run_misses ++;
+	return NULL;
+}
+
+/* the newest run stays even over budget, until the next one */
+static void
+run_trim(void)
+{
+	while (run_used > run_budget && run_tail != run_head)
+		run_free(run_tail);
+}
+
+static run_t *
+run_add(font_t *font, const char *text, unsigned int hash, int width,
+	unsigned char *col, img_t *img)
+{
+	size_t len = strlen(text);
+	run_t *r = malloc(sizeof(run_t) + len);
+	if (!r)
+		return NULL;
+	memcpy(r->text, text, len + 1);
+	r->font = font;
+	r->hash = hash;
+	r->width = width;
+	r->colored = !!col;
+	if (col)
+		memcpy(r->col, col, 4);
+	r->img = img;
+	r->size = sizeof(run_t) + len + (img ? img->w * img->h * 4 : 0);
+	r->hnext = run_hash[hash % RUN_HASH];
+	run_hash[hash % RUN_HASH] = r;
+	r->prev = NULL;
+	r->next = run_head;
+	if (run_head)
+		run_head->prev = r;
+	else
+		run_tail = r;
+	run_head = r;
+	run_used += r->size;
+	run_trim();
+	return r;
+}
+
+int
+font_width(font_t *font, const char *text)
+{
+	unsigned int hash = run_key(font, text);
+	run_t *r = run_find(font, text, hash, NULL);
+	int w;
+	if (r)
+		return r->width;
+	w = text_width(font, text);
+	run_add(font, text, hash, w, NULL, NULL);
+	return w;
+}
+
+/* rendered text, valid until the next call; NULL for empty text */
+img_t *
+font_run(font_t *font, const char *text, unsigned char *col)
+{
+	unsigned int hash = run_key(font, text);
+	run_t *r = run_find(font, text, hash, col);
+	img_t *img;
+	int w;
+	if (r)
+		return r->img;
+	w = text_width(font, text);
+	if (w <= 0 || font->height <= 0 || !(img = img_new(w, font->height)))
+		return NULL;
+	memset(img->ptr, 0, w * font->height * 4);
+	font_render(font, text, img, 0, 0, col);
+	if (!run_add(font, text, hash, w, col, img)) {
+		img_free(img);
+		return NULL;
+	}
+	return img;
+}
+
+/* set budget if it is not 0, get counters */
+void
+font_cache(size_t budget, unsigned long *hits, unsigned long *misses,
+	size_t *used, size_t *max)
+{
+	if (budget) {
+		run_budget = budget;
+		run_trim();
+	}
+	*hits = run_hits;
+	*misses = run_misses;
+	*used = run_used;
+	*max = run_budget;
+}
+
 void
 font_free(font_t *font)
 {
 	int i;
-	for (i = 0; i < MAX_GLYPHSET; i++) {
-		glyphset_t *set = font->sets[i];
-		if (!set)
-			continue;
-		free(set->image);
-		free(set);
+	run_t *r, *next;
+	for (r = run_head; r; r = next) {
+		next = r->next;
+		if (r->font == font)
+			run_free(r);
+	}
+	for (i = 0; i < MAX_GLYPHSET; i++) { /* atlas pages are shared */
+		free(font->glyphs[i]);
+		free(font->pages[i]);
 	}
+	free(font->kerns);
+	free(font->bits);
 	free(font->data);
 	free(font);
 }
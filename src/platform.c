@@ -440,6 +440,12 @@ GetPlatform(void)
 	return SDL_GetPlatform();
 }
 
+int
+CPUCount(void)
+{
+	return SDL_GetCPUCount();
+}
+
 const char *
 GetLanguage(void)
 {
@@ -540,10 +546,11 @@ WindowClear(int r, int g, int b)
 	SDL_RenderClear(renderer);
 }
 
-void
-WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int dh)
+static int expose_locked = 0;
+
+static int
+expose_prepare(int w, int h)
 {
-	SDL_Rect rect, drect;
 	int ww = 0, hh = 0, rc = 1;
 	if (expose_texture) {
 		rc = SDL_QueryTexture(expose_texture, NULL, NULL, &ww, &hh);
@@ -553,13 +560,71 @@ WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int
 		}
 	}
 	if (rc) {
+		expose_locked = 0;
 		expose_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
 			SDL_TEXTUREACCESS_STREAMING, w, h);
 		if (!expose_texture)
-			return;
+			return -1;
 	}
+	return 0;
+}
+
+void
+WindowUnlock(void)
+{
+	if (!expose_locked)
+		return;
+	SDL_UnlockTexture(expose_texture);
+	expose_locked = 0;
+}
+
+void *
+WindowLock(int w, int h, int *pitch)
+{
+	SDL_Rect rect;
+	void *pixels;
+	const char *name = renderer_info.name;
+	/* only renderers which keep texture data between locks */
+	if (!name || (strcmp(name, "software") && strcmp(name, "opengl") &&
+		strcmp(name, "opengles2") && strcmp(name, "opengles")))
+		return NULL;
+	WindowUnlock();
+	if (expose_prepare(w, h))
+		return NULL;
+	rect.x = 0; rect.y = 0; rect.w = w; rect.h = h;
+	if (SDL_LockTexture(expose_texture, &rect, &pixels, pitch))
+		return NULL;
+	expose_locked = 1;
+	return pixels;
+}
+
+int
+WindowUpdate(void *pixels, int pitch, int x, int y, int w, int h)
+{
+	SDL_Rect rect;
+	int ww, hh;
+	WindowUnlock();
+	if (!expose_texture ||
+		SDL_QueryTexture(expose_texture, NULL, NULL, &ww, &hh) ||
+		x + w > ww || y + h > hh)
+		return -1;
+	rect.x = x; rect.y = y; rect.w = w; rect.h = h;
+	return SDL_UpdateTexture(expose_texture, &rect, pixels, pitch) ? -1 : 0;
+}
+
+void
+WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int dh)
+{
+	SDL_Rect rect, drect;
+	WindowUnlock();
+	if (pixels) {
+		if (expose_prepare(w, h))
+			return;
+	} else if (!expose_texture) /* already in the texture */
+		return;
 	rect.x = 0; rect.y = 0; rect.w = w; rect.h = h;
-	SDL_UpdateTexture(expose_texture, &rect, pixels, pitch);
+	if (pixels)
+		SDL_UpdateTexture(expose_texture, &rect, pixels, pitch);
 //	SDL_RenderClear(renderer);
 	if (dx || dy || dw > 0 || dh > 0) {
 		drect.x = dx;
@@ -587,11 +652,11 @@ Flip(void)
 }
 
 void
-Icon(unsigned char *ptr, int w, int h)
+Icon(unsigned char *ptr, int w, int h, int pitch)
 {
 	SDL_Surface *surf;
 	surf = SDL_CreateRGBSurfaceFrom(ptr, w, h,
-			32, w * 4,
+			32, pitch,
 			0x000000ff,
 			0x0000ff00,
 			0x00ff0000,
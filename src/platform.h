@@ -14,6 +14,9 @@ extern void WindowSize(int *w, int *h);
 extern void WindowResize(int w, int h);
 extern void WindowClear(int r, int g, int b);
 extern void WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int dh);
+extern void *WindowLock(int w, int h, int *pitch);
+extern void WindowUnlock(void);
+extern int WindowUpdate(void *pixels, int pitch, int x, int y, int w, int h);
 
 enum { WIN_NORMAL, WIN_MAXIMIZED, WIN_FULLSCREEN };
 extern void WindowMode(int n);
@@ -24,10 +27,11 @@ extern float GetScale(void);
 extern unsigned int GetMouse(int *ox, int *oy);
 
 extern const char *GetPlatform(void);
+extern int CPUCount(void);
 extern const char *GetLanguage(void);
 extern const char *GetExePath(const char *progname);
 
-extern void Icon(unsigned char *ptr, int w, int h);
+extern void Icon(unsigned char *ptr, int w, int h, int pitch);
 extern unsigned int AudioWrite(void *data, unsigned int size);
 
 extern int sys_poll(lua_State *L);
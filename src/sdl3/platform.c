@@ -440,6 +440,12 @@ GetPlatform(void)
 	return SDL_GetPlatform();
 }
 
+int
+CPUCount(void)
+{
+	return SDL_GetNumLogicalCPUCores();
+}
+
 const char *
 GetLanguage(void)
 {
@@ -526,25 +532,81 @@ WindowSize(int *w, int *h)
 		SDL_GetWindowSizeInPixels(window, w, h);
 }
 
-void
-WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int dh)
+static int expose_w = 0, expose_h = 0;
+static int expose_locked = 0;
+
+static int
+expose_prepare(int w, int h)
 {
-	SDL_Rect rect;
-	SDL_FRect drect;
-	SDL_FRect srect;
-	static int expose_w = 0, expose_h = 0;
 	if (!expose_texture || w > expose_w || h > expose_h) {
 		SDL_DestroyTexture(expose_texture);
+		expose_locked = 0;
 		expose_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
 			SDL_TEXTUREACCESS_STREAMING, w, h);
 		if (!expose_texture)
-			return;
+			return -1;
 		SDL_SetTextureScaleMode(expose_texture, SDL_SCALEMODE_NEAREST);
 		expose_w = w; expose_h = h;
 	}
+	return 0;
+}
+
+void
+WindowUnlock(void)
+{
+	if (!expose_locked)
+		return;
+	SDL_UnlockTexture(expose_texture);
+	expose_locked = 0;
+}
+
+void *
+WindowLock(int w, int h, int *pitch)
+{
+	SDL_Rect rect;
+	void *pixels;
+	const char *name = SDL_GetRendererName(renderer);
+	/* only renderers which keep texture data between locks */
+	if (!name || (strcmp(name, "software") && strcmp(name, "opengl") &&
+		strcmp(name, "opengles2")))
+		return NULL;
+	WindowUnlock();
+	if (expose_prepare(w, h))
+		return NULL;
+	rect.x = 0; rect.y = 0; rect.w = w; rect.h = h;
+	if (!SDL_LockTexture(expose_texture, &rect, &pixels, pitch))
+		return NULL;
+	expose_locked = 1;
+	return pixels;
+}
+
+int
+WindowUpdate(void *pixels, int pitch, int x, int y, int w, int h)
+{
+	SDL_Rect rect;
+	WindowUnlock();
+	if (!expose_texture || x + w > expose_w || y + h > expose_h)
+		return -1;
+	rect.x = x; rect.y = y; rect.w = w; rect.h = h;
+	return SDL_UpdateTexture(expose_texture, &rect, pixels, pitch) ? 0 : -1;
+}
+
+void
+WindowExpose(void *pixels, int w, int h, int pitch, int dx, int dy, int dw, int dh)
+{
+	SDL_Rect rect;
+	SDL_FRect drect;
+	SDL_FRect srect;
+	WindowUnlock();
+	if (pixels) {
+		if (expose_prepare(w, h))
+			return;
+	} else if (!expose_texture) /* already in the texture */
+		return;
 	rect.x = 0; rect.y = 0;
 	rect.w = w; rect.h = h;
-	SDL_UpdateTexture(expose_texture, &rect, pixels, pitch);
+	if (pixels)
+		SDL_UpdateTexture(expose_texture, &rect, pixels, pitch);
 	if (dx || dy || dw > 0 || dh > 0) {
 		srect.x = 0; srect.y = 0;
 		srect.w = w; srect.h = h;
@@ -593,12 +655,12 @@ Flip(void)
 }
 
 void
-Icon(unsigned char *ptr, int w, int h)
+Icon(unsigned char *ptr, int w, int h, int pitch)
 {
 	SDL_Surface *surf;
 	surf = SDL_CreateSurfaceFrom(w, h,
 			SDL_PIXELFORMAT_RGBA32,
-			ptr, w * 4);
+			ptr, pitch);
 	if (!surf)
 		return;
 	SDL_SetWindowIcon(window, surf);